@@ -11,11 +11,20 @@
 #include <chrono>
 #include <concepts>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <charconv>
 
 #include <iostream>
 #include <iomanip>
 
 #include "type_name.hpp"
+#include "codec.hpp"
+#include "storage.hpp"
+#include "crc32c.hpp"
+#include "zone_map.hpp"
 
 namespace BasicLog
 {
@@ -48,6 +57,25 @@ namespace BasicLog
       const char* ptr;
       size_t count;
 
+      // floating point data stored with less precision (see Entry::store_as)
+      Storage storage = Storage::none;
+      bool is_double = false;
+      double scale = 1.0;
+      double offset = 0.0;
+
+      // number of bytes this takes up in a row
+      size_t size() const
+      {
+        if (storage == Storage::none)
+          return count;
+        return count / (is_double ? sizeof(double) : sizeof(float)) * StorageSize[(int)storage];
+      }
+
+      bool same_storage(const DataChunk& other) const
+      {
+        return storage == other.storage && is_double == other.is_double && scale == other.scale && offset == other.offset;
+      }
+
       // look for contiguous chunks of memory
       static std::vector<DataChunk> condense(std::vector<DataChunk> const& chunk)
       {
@@ -59,7 +87,7 @@ namespace BasicLog
           while (i < chunk.size())
           {
             DataChunk const* L1 = &chunk[i];
-            if (L0.ptr + L0.count == L1->ptr)
+            if (L0.ptr + L0.count == L1->ptr && L0.same_storage(*L1))
             {
               L0.count += L1->count;
             }
@@ -80,6 +108,9 @@ namespace BasicLog
     // something to be logged
     struct Entry; // forward declare so we can define StructMemberEntry
 
+    // many logs sharing one file
+    class Container;
+
     // the member of a struct to be logged
     template <is_Class B>
     using StructMemberEntry = std::function<Entry(B const* const)>;
@@ -156,7 +187,7 @@ namespace BasicLog
           c.parent_index = ind; // order in which they were encoutered
           // add this child to the list
           children.push_back(c);
-          type_size += c.type_size;
+          type_size += c.type_size * c.count;
         }
         type = std::to_string(type_size);
 
@@ -213,6 +244,30 @@ namespace BasicLog
         : Entry(Name, Description, Ptr, 1, child_entries...)
       { }
 
+      // store a floating point entry with less precision (lossy). float32/float16/bfloat16 round to nearest.
+      // the integer types store round((value - Offset) / Scale), saturated, which is read back as stored * Scale + Offset.
+      // their smallest value is reserved for nan (so int8 saturates at -127)
+      Entry store_as(Storage S, double Scale = 1.0, double Offset = 0.0) const
+      {
+        if (type != type_name_v<double> && type != type_name_v<float>)
+          throw error("only floating point entries can be stored with less precision");
+        if (is_integer_storage(S) && (Scale == 0.0 || !std::isfinite(Scale) || !std::isfinite(Offset)))
+          throw error("scale must be finite and non-zero, offset must be finite");
+        Entry e(*this);
+        e.storage = S;
+        e.scale = is_integer_storage(S) ? Scale : 1.0;
+        e.offset = is_integer_storage(S) ? Offset : 0.0;
+        e.type_size = S == Storage::none ? (type == type_name_v<double> ? sizeof(double) : sizeof(float)) : StorageSize[(int)S];
+        for (auto& d : e.data)
+        {
+          d.storage = S;
+          d.is_double = type == type_name_v<double>;
+          d.scale = e.scale;
+          d.offset = e.offset;
+        }
+        return e;
+      }
+
       std::string header() const
       {
         static constexpr std::string_view q = "\"";
@@ -225,8 +280,15 @@ namespace BasicLog
         static constexpr std::string_view type = "\"type\":";
         static constexpr std::string_view ind = "\"ind\":";
         static constexpr std::string_view count = "\"count\":";
-        //{"name":"{name}","desc":"{description}","type":"{type}","count":{count},"parent":"{parent_name}","ind":{parent_index}}
-        auto h = std::string(l).append(name).append(q).append(this->name).append(qc).append(desc).append(q).append(this->description).append(qc).append(type).append(q).append(this->type).append(qc).append(count).append(std::to_string(this->count)).append(c).append(ind).append(std::to_string(this->parent_index)).append(r);
+        static constexpr std::string_view storage = "\"storage\":";
+        static constexpr std::string_view scale = "\"scale\":";
+        static constexpr std::string_view offset = "\"offset\":";
+        // shortest text that reads back as the same double
+        auto number = [](double value) { char b[32]; return std::string(b, std::to_chars(b, b + sizeof(b), value).ptr); };
+        // every entry has the storage fields (even if it's not using them) so they all decode to the same struct in matlab
+        //{"name":"{name}","desc":"{description}","type":"{type}","count":{count},"ind":{parent_index},"storage":"{storage}","scale":{scale},"offset":{offset}}
+        auto h = std::string(l).append(name).append(q).append(this->name).append(qc).append(desc).append(q).append(this->description).append(qc).append(type).append(q).append(this->type).append(qc).append(count).append(std::to_string(this->count)).append(c).append(ind).append(std::to_string(this->parent_index)).append(c)
+          .append(storage).append(q).append(StorageName[(int)this->storage]).append(qc).append(scale).append(number(this->scale)).append(c).append(offset).append(number(this->offset)).append(r);
         if (is_contiguous)
         {
           for (auto& h2 : children)
@@ -294,6 +356,9 @@ namespace BasicLog
       size_t type_size;
       size_t count;
       size_t parent_index;
+      Storage storage = Storage::none;
+      double scale = 1.0;
+      double offset = 0.0;
 
       // for the data
       std::vector<DataChunk> data;
@@ -301,20 +366,33 @@ namespace BasicLog
       bool is_contiguous;
     };
 
-    // how the logged data is written to the file
+    // how the logged data is written to the file. any codec in the CodecRegistry can also be selected by name
     enum CompressionMethod
     {
-      // remmeber to update "CompressionMethodName" and "CompressionMethodFunction" also!
+      // remmeber to update "CompressionMethodName" also!
       RAW,
       DIFF1,
+      DIFF2,
+      ADAPTIVE, // pick the best of several codecs for each block of rows (see set_adaptive)
       CompressionMethodCount
     };
 
+    // list of compression method names (to be included in the log header)
+    static constexpr std::string_view CompressionMethodName[CompressionMethodCount] = { "RAW", "DIFF1", "DIFF2", "ADAPTIVE" };
+
     Log() { };
 
-    Log(const std::string_view Name, const std::string_view Description, CompressionMethod Compression, std::vector<Entry> child_entries)
-      : MainEntry(Name, Description, child_entries), selected_recorder(CompressionMethodFunction[Compression]), current_recorder(&Log::record_NULL)
+    Log(const std::string_view Name, const std::string_view Description, const std::string_view Compression, std::vector<Entry> child_entries)
+      : MainEntry(Name, Description, child_entries), compression(Compression), selected_recorder(&Log::record_STREAM), current_recorder(&Log::record_NULL)
     {
+      if (compression == CompressionMethodName[ADAPTIVE])
+      {
+        selected_recorder = &Log::record_BLOCK;
+        adaptive_codecs = { std::string(CompressionMethodName[RAW]), std::string(CompressionMethodName[DIFF1]) };
+      }
+      else if (!CodecRegistry::contains(compression))
+        throw MainEntry.error(std::string("unknown compression method: ").append(compression));
+
       MainEntry.parent_index = 0;
       std::vector<Entry> AllEntries;
       std::function<void(Entry)> flatten;
@@ -338,9 +416,6 @@ namespace BasicLog
       flatten(MainEntry);
       Entry::sort_entries(AllEntries);
       std::vector<DataChunk> AllChunks;
-      header.append("{\n");
-      header.append("\"compression\":\"").append(CompressionMethodName[Compression]).append("\",\n");
-      header.append("\"data_header\":[\n");
       bool first = true;
       for (auto& c : AllEntries)
       {
@@ -348,17 +423,18 @@ namespace BasicLog
         if (first)
           first = false;
         else
-          header.append(",\n");
-        header.append(c.header());
+          data_header.append(",\n");
+        data_header.append(c.header());
       }
       data = DataChunk::condense(AllChunks);
-      size_t total_size = std::accumulate(data.begin(), data.end(), 0, [](size_t sum, const DataChunk& E) { return sum + E.count; });
+      size_t total_size = std::accumulate(data.begin(), data.end(), 0, [](size_t sum, const DataChunk& E) { return sum + E.size(); });
 
-      previous_row = std::vector<char>(total_size, 0);
+      row = std::vector<char>(total_size, 0);
+      header = make_header();
 
-      header.append("\n],\n");
-      header.append("\"row_size\":").append(std::to_string(total_size));
-      header.append("\n}");
+      size_t offset = 0;
+      for (auto& c : AllEntries)
+        add_zone_field(c, offset);
 
       // display stuff (for now)
       std::cout << header << '\n';
@@ -368,36 +444,185 @@ namespace BasicLog
       }
     }
 
+    Log(const std::string_view Name, const std::string_view Description, CompressionMethod Compression, std::vector<Entry> child_entries)
+      : Log(Name, Description, CompressionMethodName[Compression], child_entries)
+    { }
+
+    Log(const std::string_view Name, const std::string_view Description, const std::string_view Compression, std::convertible_to<const Entry> auto const... child_entries)
+      : Log(Name, Description, Compression, { child_entries... })
+    { }
+
     Log(const std::string_view Name, const std::string_view Description, CompressionMethod Compression, std::convertible_to<const Entry> auto const... child_entries)
       : Log(Name, Description, Compression, { child_entries... })
     { }
 
+    ~Log()
+    {
+      stop();
+    }
+
+    // only while stopped
+    Log(Log&&) = default;
+    Log& operator=(Log&&) = default;
+
     std::string_view name() const
     {
       return MainEntry.name;
     }
 
+    // tune the ADAPTIVE method (only while stopped). every Block_rows rows are written as one block using whichever of
+    // Codecs is cheapest on the first Sample_rows rows of that block. cost = encoded bytes + Cpu_weight * encode nanoseconds
+    void set_adaptive(size_t Block_rows, std::vector<std::string> Codecs, size_t Sample_rows = 16, double Cpu_weight = 0.1)
+    {
+      if (compression != CompressionMethodName[ADAPTIVE])
+        throw MainEntry.error("set_adaptive requires the ADAPTIVE compression method");
+      if (current_recorder != &Log::record_NULL)
+        throw MainEntry.error("cannot change compression while logging");
+      if (Block_rows == 0 || Block_rows > UINT32_MAX)
+        throw MainEntry.error("block size must be between 1 and 2^32-1 rows");
+      if (Codecs.empty() || Codecs.size() > UINT8_MAX)
+        throw MainEntry.error("expecting between 1 and 255 codecs");
+      for (auto& c : Codecs)
+      {
+        if (!CodecRegistry::contains(c))
+          throw MainEntry.error(std::string("unknown codec: ").append(c));
+      }
+      block_rows = Block_rows;
+      adaptive_codecs = Codecs;
+      sample_rows = std::max<size_t>(Sample_rows, 1);
+      cpu_weight = Cpu_weight;
+      header = make_header();
+    }
+
+    // start every block with a sync marker and add a CRC32C of it so readers can detect damage and skip to the next
+    // block (only while stopped). framed logs are written a block of Block_rows rows at a time whatever the compression
+    // method (0 keeps the current block size, ADAPTIVE's comes from set_adaptive)
+    void set_framing(bool Enable, size_t Block_rows = 0)
+    {
+      if (current_recorder != &Log::record_NULL)
+        throw MainEntry.error("cannot change framing while logging");
+      if (Block_rows > UINT32_MAX)
+        throw MainEntry.error("block size must be between 1 and 2^32-1 rows");
+      framed = Enable;
+      if (Block_rows > 0)
+        block_rows = Block_rows;
+      use_blocks();
+    }
+
+    // write a min/max (and optionally sum) of every field for each block to <name>.zmap next to the log so readers
+    // can skip blocks that can't match a query (see zone_map.hpp). only while stopped. like framing this writes the log
+    // a block at a time whatever the compression method
+    void set_zone_maps(bool Enable, bool Sums = false, size_t Block_rows = 0)
+    {
+      if (current_recorder != &Log::record_NULL)
+        throw MainEntry.error("cannot change zone maps while logging");
+      if (Block_rows > UINT32_MAX)
+        throw MainEntry.error("block size must be between 1 and 2^32-1 rows");
+      zone_maps = Enable;
+      zone_sums = Sums;
+      if (Block_rows > 0)
+        block_rows = Block_rows;
+      use_blocks();
+    }
+
     void start(std::filesystem::path directory)
     {
       if (directory.empty())
         throw MainEntry.error("cannot begin logging to an empty directory");
-      // create the new file
-      auto file_path = directory / (MainEntry.name + ".cap");
-      log_file.open(file_path, std::ios_base::binary | std::ios_base::trunc);
-      if (!log_file)
-        throw MainEntry.error(std::string("failed to create log file: ").append(file_path));
-
-      log_file << header << '\0';						// add the header followed by 0
+      if (current_recorder != &Log::record_NULL)
+        stop();
+      open_file(directory / (MainEntry.name + ".cap"), header);
+      begin();
       current_recorder = selected_recorder; // update the recorder function
-      // init recorder states
-      std::fill(previous_row.begin(), previous_row.end(), 0);
+    }
+
+    // log into a container shared with other logs instead of a file of its own (the container holds the header)
+    void start(Container& Destination, uint16_t Tag)
+    {
+      if (current_recorder != &Log::record_NULL)
+        stop();
+      container = &Destination;
+      container_tag = Tag;
+      pending.clear();
+      pending.reserve(2 * container->block_size);
+      if (zone_maps)
+        open_zone_file(container->directory() / (MainEntry.name + ".zmap"));
+      begin();
+      current_recorder = selected_recorder;
+    }
+
+    // flight recorder: keep recent rows in memory (at most Memory bytes of them, twice that while a capture is being
+    // written) instead of writing them anywhere. trigger() writes the rows from Pre before the trigger to Post after it
+    // to a file. recording starts over after each capture so the next one's Pre window begins there
+    void start_flight_recorder(std::chrono::steady_clock::duration Pre, std::chrono::steady_clock::duration Post, size_t Memory)
+    {
+      if (current_recorder != &Log::record_NULL)
+        stop();
+      if (!recorder)
+        recorder = std::make_unique<Recorder>();
+      ring_rows = std::max<size_t>(Memory / row.size(), 2);
+      recorder->spare.resize(1);
+      for (Ring* r : { &ring, &recorder->spare[0] })
+      {
+        r->rows.resize(ring_rows * row.size());
+        r->time.resize(ring_rows);
+        r->head = 0;
+        r->count = 0;
+      }
+      pre_trigger = Pre;
+      post_trigger = Post;
+      recorder->pending.store(false);
+      recorder->stop = false;
+      recorder->thread = std::thread(&Log::write_captures, this);
+      current_recorder = &Log::record_RING;
+    }
+
+    // flight recorder: capture the rows around now to a file in 'directory' (written in the background once the post trigger
+    // window has passed). returns false if not running as a flight recorder or a capture is already pending.
+    // failing to write a capture doesn't stop recording, it's reported on std::cerr
+    bool trigger(std::filesystem::path directory)
+    {
+      if (!recorder)
+        return false;
+      std::lock_guard<std::mutex> guard(recorder->trigger_lock);
+      if (current_recorder != &Log::record_RING || recorder->pending.load())
+        return false;
+      recorder->directory = directory;
+      recorder->trigger = std::chrono::steady_clock::now();
+      recorder->unix_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+      recorder->pending.store(true, std::memory_order_release);
+      return true;
     }
 
     void stop(void)
     {
+      if (current_recorder == &Log::record_RING)
+      {
+        if (recorder->pending.load(std::memory_order_acquire))
+          capture(); // with whatever we have
+        {
+          std::lock_guard<std::mutex> guard(recorder->lock);
+          recorder->stop = true;
+        }
+        recorder->ready.notify_one();
+        recorder->thread.join(); // once the queued captures are written
+        current_recorder = &Log::record_NULL;
+        return;
+      }
+      if (current_recorder != &Log::record_NULL)
+        end();
       current_recorder = &Log::record_NULL;
-      log_file.flush();
-      log_file.close();
+      if (container)
+      {
+        flush_pending();
+        container = nullptr;
+      }
+      else
+      {
+        log_file.flush();
+        log_file.close();
+      }
+      zone_file.close();
     }
 
     void record(void)
@@ -408,73 +633,515 @@ namespace BasicLog
     // private:
     void record_NULL(void) { }
 
-    void record_RAW(void)
+    void open_file(const std::filesystem::path& file_path, const std::string_view file_header)
     {
-      for (auto& e : data)
+      log_file.open(file_path, std::ios_base::binary | std::ios_base::trunc);
+      if (!log_file)
+        throw MainEntry.error(std::string("failed to create log file: ").append(file_path));
+      log_file << file_header << '\0'; // add the header followed by 0
+      if (zone_maps)
+        open_zone_file(std::filesystem::path(file_path).replace_extension(".zmap"));
+    }
+
+    void open_zone_file(const std::filesystem::path& file_path)
+    {
+      zone_file.open(file_path, std::ios_base::binary | std::ios_base::trunc);
+      if (!zone_file)
+        throw MainEntry.error(std::string("failed to create zone map file: ").append(file_path));
+      zone_file << "{\"zone_map\":1,\"log\":\"" << MainEntry.name << "\",\"row_size\":" << row.size() << ",\"sums\":" << (zone_sums ? "true" : "false") << ",\"fields\":[";
+      for (size_t i = 0; i < zone_fields.size(); i++)
+        zone_file << (i ? ",\n" : "\n") << "{\"name\":\"" << zone_fields[i].name << "\",\"type\":\"" << zone_fields[i].type << "\"}";
+      zone_file << "\n]}" << '\0';
+    }
+
+    // init recorder states
+    void begin(void)
+    {
+      stream_bytes = 0;
+      if (selected_recorder == &Log::record_BLOCK)
       {
-        log_file.write(e.ptr, e.count);
+        candidates.clear();
+        for (auto& c : adaptive_codecs)
+          candidates.push_back(CodecRegistry::make(c));
+        block.resize(block_rows * row.size());
+        block_count = 0;
+      }
+      else
+      {
+        codec = CodecRegistry::make(compression);
+        codec->reset(row.size());
+      }
+    }
+
+    // write out anything the recorder is still holding on to
+    void end(void)
+    {
+      if (selected_recorder == &Log::record_BLOCK)
+        flush_block();
+      else
+      {
+        encoded.clear();
+        codec->finish(encoded);
+        write(encoded.data(), encoded.size());
       }
     }
 
-    std::vector<char> previous_row;
-    void record_DIFF1(void)
+    // everything recorded ends up here
+    void write(const char* bytes, size_t size)
     {
-      const size_t num_bytes = previous_row.size();
-      const size_t num_bits = num_bytes / 8 + (num_bytes % 8 > 0); // number of bytes we need to get at least one bit per byte
-      std::vector<char> prefix(num_bits, 0);
-      std::vector<char> delta(num_bytes, 0);
-      std::vector<char> row(num_bytes, 0);
+      stream_bytes += size;
+      if (container)
+      {
+        pending.insert(pending.end(), bytes, bytes + size);
+        if (pending.size() >= container->block_size)
+          flush_pending();
+      }
+      else
+        log_file.write(bytes, size);
+    }
 
+    // hand what we have so far to the container (dropped if it's already been closed)
+    void flush_pending(void)
+    {
+      if (pending.empty())
+        return;
+      if (!container->is_open())
+      {
+        pending.clear();
+        return;
+      }
+      container->write_block(container_tag, pending.data(), pending.size());
+      pending.clear();
+    }
 
-      // copy all the data to be logged into a buffer
-      size_t pos = 0;
+    // copy all the data to be logged into a row
+    void gather_row(char* dst) const
+    {
       for (auto& e : data)
       {
-        for (size_t i = 0; i < e.count; i++)
+        if (e.storage == Storage::none)
+          std::memcpy(dst, e.ptr, e.count);
+        else if (e.is_double)
+          store(e.storage, (const double*)e.ptr, e.count / sizeof(double), e.scale, e.offset, dst);
+        else
+          store(e.storage, (const float*)e.ptr, e.count / sizeof(float), e.scale, e.offset, dst);
+        dst += e.size();
+      }
+    }
+
+    // encode a row that's already been gathered
+    void put_row(const char* r)
+    {
+      if (selected_recorder == &Log::record_BLOCK)
+      {
+        std::memcpy(block.data() + block_count * row.size(), r, row.size());
+        if (++block_count == block_rows)
+          flush_block();
+      }
+      else
+      {
+        encoded.clear();
+        codec->encode(r, encoded);
+        write(encoded.data(), encoded.size());
+      }
+    }
+
+    // each row goes straight through the codec
+    void record_STREAM(void)
+    {
+      gather_row(row.data());
+      put_row(row.data());
+    }
+
+    // rows are collected then written a block at a time
+    void record_BLOCK(void)
+    {
+      gather_row(block.data() + block_count * row.size());
+      if (++block_count == block_rows)
+        flush_block();
+    }
+
+    // flight recorder: rows go into the ring. no disk io
+    void record_RING(void)
+    {
+      const auto t = std::chrono::steady_clock::now();
+      gather_row(ring.rows.data() + ring.head * row.size());
+      ring.time[ring.head] = t;
+      ring.head = (ring.head + 1) % ring_rows;
+      ring.count = std::min(ring.count + 1, ring_rows);
+      if (recorder->pending.load(std::memory_order_acquire))
+      {
+        // done once the post trigger window has passed (or the next row would overwrite one we need)
+        const bool full = ring.count == ring_rows && ring.time[ring.head] >= recorder->trigger - pre_trigger;
+        if (t - recorder->trigger >= post_trigger || full)
+          capture();
+      }
+    }
+
+    struct Capture; // with the flight recorder's members below
+
+    // hand the ring to write_captures and carry on in a spare one
+    void capture(void)
+    {
+      Capture c{ std::move(ring), recorder->directory, recorder->trigger, recorder->unix_time_ns };
+      bool spare = false;
+      {
+        std::lock_guard<std::mutex> guard(recorder->lock);
+        recorder->captures.push_back(std::move(c));
+        if (!recorder->spare.empty())
         {
-          row[pos++] = e.ptr[i];
+          ring = std::move(recorder->spare.back());
+          recorder->spare.pop_back();
+          spare = true;
         }
       }
+      recorder->ready.notify_one();
+      if (!spare) // the last capture is still being written
+      {
+        ring.rows.resize(ring_rows * row.size());
+        ring.time.resize(ring_rows);
+      }
+      ring.head = 0;
+      ring.count = 0;
+      recorder->pending.store(false, std::memory_order_release);
+    }
 
-      // compute the delta
-      for (size_t i = 0; i < num_bytes; i++)
-        delta[i] = row[i] - previous_row[i];
+    // the flight recorder's background thread. captures are written one at a time (they share the log's encoder, which
+    // nothing else uses while recording to the ring)
+    void write_captures(void)
+    {
+      std::unique_lock<std::mutex> guard(recorder->lock);
+      while (true)
+      {
+        recorder->ready.wait(guard, [this] { return recorder->stop || !recorder->captures.empty(); });
+        if (recorder->captures.empty())
+          return;
+        Capture c = std::move(recorder->captures.front());
+        recorder->captures.pop_front();
+        guard.unlock();
+        try
+        {
+          write_capture(c);
+        }
+        catch (const std::exception& e)
+        {
+          log_file.close();
+          zone_file.close();
+          std::cerr << "failed to write a capture of " << MainEntry.name << ": " << e.what() << '\n';
+        }
+        guard.lock();
+        recorder->spare.push_back(std::move(c.ring));
+      }
+    }
 
-      // save the previous row
-      previous_row = row;
+    // the rows of c.ring within the trigger window
+    void write_capture(const Capture& c)
+    {
+      const auto in_window = [&](size_t i) { return c.ring.time[i] >= c.trigger - pre_trigger && c.ring.time[i] <= c.trigger + post_trigger; };
+      const size_t first = c.ring.head + ring_rows - c.ring.count; // oldest row (mod ring_rows)
+      size_t trigger_row = 0; // rows before the trigger
+      for (size_t k = 0; k < c.ring.count; k++)
+      {
+        const size_t i = (first + k) % ring_rows;
+        if (in_window(i) && c.ring.time[i] < c.trigger)
+          trigger_row++;
+      }
+      std::string extra = std::string("\"trigger_row\":").append(std::to_string(trigger_row)).append(",\n");
+      extra.append("\"trigger_unix_time_ns\":").append(std::to_string(c.unix_time_ns)).append(",\n");
+
+      std::filesystem::create_directories(c.directory);
+      // more than one capture in the same directory gets a number
+      auto file_path = c.directory / (MainEntry.name + ".cap");
+      for (int n = 2; std::filesystem::exists(file_path); n++)
+        file_path = c.directory / (MainEntry.name + "_" + std::to_string(n) + ".cap");
+      open_file(file_path, make_header(extra));
+      begin();
+      for (size_t k = 0; k < c.ring.count; k++)
+      {
+        const size_t i = (first + k) % ring_rows;
+        if (in_window(i))
+          put_row(c.ring.rows.data() + i * row.size());
+      }
+      end();
+      log_file.flush();
+      log_file.close();
+      zone_file.close();
+    }
 
-      // compute the prefix and data to be logged
-//      std::fill(prefix.begin(), prefix.end(), 0); // zero the prefix
-      std::vector<char> bytes_to_log;
-      for (size_t i = 0; i < num_bytes; i++)
+    // which of the candidates is cheapest for the current block (based on a sample of its rows)
+    uint8_t choose_codec(void)
+    {
+      if (candidates.size() == 1)
+        return 0;
+      const size_t row_size = row.size();
+      const size_t n = std::min(sample_rows, block_count);
+      uint8_t best = 0;
+      double best_cost = 0;
+      for (size_t k = 0; k < candidates.size(); k++)
       {
-        if (delta[i] == 0)
-          continue;
-        size_t h_ind = i / 8;
-        int b_ind = i % 8;
-        prefix[h_ind] |= 1U << b_ind; // set the bit
-        bytes_to_log.push_back(delta[i]); // insert the data
+        auto& c = *candidates[k];
+        sample.clear();
+        auto t0 = std::chrono::steady_clock::now();
+        c.reset(row_size);
+        for (size_t i = 0; i < n; i++)
+          c.encode(block.data() + i * row_size, sample);
+        c.finish(sample);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        double cost = sample.size() + cpu_weight * ns;
+        if (k == 0 || cost < best_cost)
+        {
+          best = (uint8_t)k;
+          best_cost = cost;
+        }
       }
+      return best;
+    }
 
-      // finally write the prefix and data
-      log_file.write(prefix.data(), prefix.size());
-      log_file.write(bytes_to_log.data(), bytes_to_log.size());
+    // see block_format
+    void flush_block(void)
+    {
+      if (block_count == 0)
+        return;
+      const size_t row_size = row.size();
+      const uint8_t index = choose_codec();
+      auto& c = *candidates[index];
+      const size_t header_size = framed ? block_format::framed_header_size : block_format::header_size;
+      encoded.resize(header_size);
+      // RAW is the block as it is so it's written from there rather than copied through the codec
+      const bool raw = adaptive_codecs[index] == CompressionMethodName[RAW];
+      if (!raw)
+      {
+        c.reset(row_size);
+        for (size_t i = 0; i < block_count; i++)
+          c.encode(block.data() + i * row_size, encoded);
+        c.finish(encoded);
+      }
+      const char* payload = raw ? block.data() : encoded.data() + header_size;
+      const uint32_t rows = block_count;
+      const uint32_t bytes = raw ? block_count * row_size : encoded.size() - header_size;
+      char* h = encoded.data();
+      if (framed)
+      {
+        std::memcpy(h, block_format::marker.data(), block_format::marker.size());
+        h += block_format::marker.size();
+      }
+      h[0] = index;
+      std::memcpy(h + 1, &rows, sizeof(rows));
+      std::memcpy(h + 5, &bytes, sizeof(bytes));
+      if (framed)
+      {
+        const uint32_t crc = crc32c(payload, bytes, crc32c(h, block_format::header_size));
+        std::memcpy(h + block_format::header_size, &crc, sizeof(crc));
+      }
+      if (zone_file.is_open())
+        write_zones(stream_bytes);
+      if (raw)
+      {
+        write(encoded.data(), header_size);
+        write(payload, bytes);
+      }
+      else
+        write(encoded.data(), encoded.size());
+      block_count = 0;
     }
 
-    // list of compression method names (to be included in the log header)
-    static constexpr std::string_view CompressionMethodName[CompressionMethodCount] = { "RAW", "DIFF1" };
+    // framing and zone maps need the log written a block at a time
+    void use_blocks(void)
+    {
+      if (compression != CompressionMethodName[ADAPTIVE])
+      {
+        selected_recorder = framed || zone_maps ? &Log::record_BLOCK : &Log::record_STREAM;
+        adaptive_codecs = { compression };
+      }
+      header = make_header();
+    }
 
-    // list of compression method member functions (to be used to actually record the data)
+    // the fundamental entries of a row. named and merged (struct arrays) the same way the header is read back
+    void add_zone_field(const Entry& e, size_t& offset)
+    {
+      if (e.type.empty())
+        return; // simple container (its children are listed separately)
+      auto summarize = zone_map::summarizer_for(e.type);
+      if (!summarize)
+      {
+        // struct (array)
+        for (size_t i = 0; i < e.count; i++)
+        {
+          for (auto& c : e.children)
+            add_zone_field(c, offset);
+        }
+        return;
+      }
+      auto f = std::find_if(zone_fields.begin(), zone_fields.end(), [&](const ZoneField& F) { return F.name == e.name; });
+      if (f == zone_fields.end())
+      {
+        // values stored with less precision are summarized after reading them back
+        zone_fields.push_back(ZoneField{ e.name, e.type, e.type_size, e.count, {}, e.storage, e.scale, e.offset,
+          e.storage == Storage::none ? summarize : zone_map::summarize_bytes<double> });
+        f = zone_fields.end() - 1;
+      }
+      f->offsets.push_back(offset);
+      offset += e.type_size * e.count;
+    }
+
+    // summarize the current block. 'block_offset' is where it starts in the stream
+    void write_zones(uint64_t block_offset)
+    {
+      const size_t row_size = row.size();
+      const uint32_t rows = block_count;
+      zone_record.resize(zone_map::record_header_size);
+      std::memcpy(&zone_record[0], &block_offset, sizeof(block_offset));
+      std::memcpy(&zone_record[8], &rows, sizeof(rows));
+      for (auto& f : zone_fields)
+      {
+        // the field's values one after another
+        const size_t bytes = f.count * f.type_size;
+        const size_t n = block_count * f.offsets.size() * f.count;
+        zone_column.resize((n * f.type_size + sizeof(double) - 1) / sizeof(double));
+        char* column = (char*)zone_column.data();
+        for (size_t r = 0; r < block_count; r++)
+        {
+          for (size_t o : f.offsets)
+          {
+            std::memcpy(column, block.data() + r * row_size + o, bytes);
+            column += bytes;
+          }
+        }
+        column = (char*)zone_column.data();
+        if (f.storage != Storage::none)
+        {
+          zone_values.resize(n);
+          load(f.storage, column, n, f.scale, f.offset, zone_values.data());
+          if (f.type == type_name_v<float>)
+          {
+            for (auto& v : zone_values)
+              v = (float)v; // what a reader gets back
+          }
+          column = (char*)zone_values.data();
+        }
+        const auto s = f.summarize(column, n, zone_sums);
+        const double v[3] = { s.min, s.max, s.sum };
+        const char* p = (const char*)v;
+        zone_record.insert(zone_record.end(), p, p + (zone_sums ? 3 : 2) * sizeof(double));
+      }
+      zone_file.write(zone_record.data(), zone_record.size());
+    }
+
+    // 'extra' is inserted as is (it should end with ",\n")
+    std::string make_header(const std::string_view extra = "") const
+    {
+      std::string h("{\n");
+      h.append(extra);
+      h.append("\"compression\":\"").append(compression).append("\",\n");
+      if (selected_recorder == &Log::record_BLOCK)
+      {
+        h.append("\"codecs\":[");
+        for (size_t i = 0; i < adaptive_codecs.size(); i++)
+          h.append(i ? ",\"" : "\"").append(adaptive_codecs[i]).append("\"");
+        h.append("],\n");
+        h.append("\"block_rows\":").append(std::to_string(block_rows)).append(",\n");
+        if (framed)
+          h.append("\"framing\":\"CRC32C\",\n");
+      }
+      h.append("\"data_header\":[\n");
+      h.append(data_header);
+      h.append("\n],\n");
+      h.append("\"row_size\":").append(std::to_string(row.size()));
+      h.append("\n}");
+      return h;
+    }
+
+    // the record methods
     typedef void (Log::* RecordFun)(void);
-    static constexpr RecordFun CompressionMethodFunction[CompressionMethodCount] = { &Log::record_RAW, &Log::record_DIFF1 };
 
     Entry MainEntry;						 // each log has a top level entry. this is it.
+    std::string compression;     // name of the codec (or ADAPTIVE)
+    std::string data_header;     // the header of each entry
     std::string header;					 // this logs header
     std::vector<DataChunk> data; // this logs data
-    RecordFun selected_recorder; // the selected record method
-    RecordFun current_recorder;	 // the recorder that's currently being used (either null or selected)
+    RecordFun selected_recorder = &Log::record_STREAM; // the selected record method
+    RecordFun current_recorder = &Log::record_NULL;    // the recorder that's currently being used (either null or selected)
+
+    std::unique_ptr<Codec> codec;                   // for record_STREAM
+    std::vector<std::string> adaptive_codecs;       // for record_BLOCK
+    std::vector<std::unique_ptr<Codec>> candidates; // instances of adaptive_codecs
+    size_t block_rows = 256;
+    size_t sample_rows = 16;
+    double cpu_weight = 0.1;
+    size_t block_count = 0;
+    bool framed = false; // see set_framing
+
+    // zone maps (see set_zone_maps)
+    struct ZoneField
+    {
+      std::string name;
+      std::string type;
+      size_t type_size; // bytes per element in a row
+      size_t count;
+      std::vector<size_t> offsets;
+      Storage storage;
+      double scale;
+      double offset;
+      zone_map::Summarizer summarize;
+    };
+    bool zone_maps = false;
+    bool zone_sums = false;
+    std::vector<ZoneField> zone_fields;
+    std::ofstream zone_file;
+    uint64_t stream_bytes = 0;       // written since the log's header
+    std::vector<double> zone_column; // one field of the current block (doubles so it's aligned for any type)
+    std::vector<double> zone_values; // the same read back (when stored with less precision)
+    std::vector<char> zone_record;
+
+    std::vector<char> row;     // the current row
+    std::vector<char> block;   // the rows of the current block
+    std::vector<char> encoded; // codec output (kept around so recording doesn't allocate)
+    std::vector<char> sample;  // codec output while choosing a codec
+
+    // flight recorder. rows go into the active ring, a capture hands the whole ring to write_captures and carries on in
+    // a spare one (so the recording thread never copies or allocates)
+    struct Ring
+    {
+      std::vector<char> rows;                                  // the most recent rows
+      std::vector<std::chrono::steady_clock::time_point> time; // when each was recorded
+      size_t head = 0;  // where the next row goes
+      size_t count = 0; // rows in the ring
+    };
+    Ring ring;
+    size_t ring_rows = 0;
+    std::chrono::steady_clock::duration pre_trigger;
+    std::chrono::steady_clock::duration post_trigger;
 
     std::ofstream log_file;
+    Container* container = nullptr; // when logging into a container instead of log_file
+    uint16_t container_tag = 0;     // this logs tag within the container
+    std::vector<char> pending;      // bytes not yet handed to the container
+
+    // a full ring waiting for write_captures with the trigger it's for
+    struct Capture
+    {
+      Ring ring;
+      std::filesystem::path directory;
+      std::chrono::steady_clock::time_point trigger;
+      int64_t unix_time_ns;
+    };
+    // what's shared with trigger() and write_captures. behind a pointer so the log stays movable
+    struct Recorder
+    {
+      std::atomic<bool> pending = false; // triggered, not yet captured
+      std::chrono::steady_clock::time_point trigger;
+      int64_t unix_time_ns = 0;
+      std::filesystem::path directory;
+      std::mutex trigger_lock;
+
+      std::deque<Capture> captures;
+      std::vector<Ring> spare; // rings write_captures is done with
+      std::mutex lock;         // captures and spare
+      std::condition_variable ready;
+      bool stop = false;
+      std::thread thread;
+    };
+    std::unique_ptr<Recorder> recorder; // once start_flight_recorder has been called
 
     // static methods
   public:
@@ -516,6 +1183,135 @@ namespace BasicLog
       return now().time_since_epoch().count();
     }
 
+    // the output of many logs in one file, written through a single buffer. the file is:
+    // {"container":1,"logs":[log names by tag]}, 0, each logs header followed by 0 (in tag order),
+    // then blocks of: tag (uint16), byte count (uint32), bytes
+    // closing it adds an index of the blocks: tag (uint16), offset (uint64), byte count (uint32) for each block
+    // followed by the offset of the index (uint64), number of blocks (uint32), and "CAPCIDX1"
+    class Container
+    {
+      struct IndexEntry
+      {
+        uint16_t tag;
+        uint64_t offset;
+        uint32_t size;
+      };
+
+      std::filesystem::path path;
+      std::ofstream file;
+      std::vector<char> buffer;      // not yet written to the file
+      uint64_t buffer_offset = 0;    // file offset of buffer[0]
+      std::vector<IndexEntry> index;
+      std::mutex lock;
+
+      template <typename T>
+      static void append(std::vector<char>& v, const T value)
+      {
+        v.insert(v.end(), (const char*)&value, (const char*)&value + sizeof(T));
+      }
+
+      void write_buffer(void)
+      {
+        file.write(buffer.data(), buffer.size());
+        buffer_offset += buffer.size();
+        buffer.clear();
+      }
+
+    public:
+      static constexpr std::string_view extension = ".capc";
+      static constexpr std::string_view index_magic = "CAPCIDX1";
+      static constexpr size_t max_logs = UINT16_MAX + 1;
+      size_t block_size = 4096;     // each log hands over its bytes in blocks of about this size
+      size_t buffer_size = 1 << 20; // bytes collected before writing to the file
+
+      Container() { }
+
+      Container(const Container&) = delete;
+      Container& operator=(const Container&) = delete;
+
+      ~Container()
+      {
+        close();
+      }
+
+      void open(const std::filesystem::path& file_path, std::vector<Log*> const& logs)
+      {
+        if (logs.size() > max_logs)
+          throw std::runtime_error("a container holds at most " + std::to_string(max_logs) + " logs");
+        close();
+        path = file_path;
+        file.open(file_path, std::ios_base::binary | std::ios_base::trunc);
+        if (!file)
+          throw std::runtime_error(std::string("failed to create container file: ").append(file_path));
+        std::string directory("{\"container\":1,\"logs\":[");
+        for (size_t i = 0; i < logs.size(); i++)
+          directory.append(i ? ",\"" : "\"").append(logs[i]->name()).append("\"");
+        directory.append("]}");
+        buffer.clear();
+        buffer.reserve(buffer_size + block_size);
+        buffer.insert(buffer.end(), directory.begin(), directory.end());
+        buffer.push_back('\0');
+        for (auto L : logs)
+        {
+          buffer.insert(buffer.end(), L->header.begin(), L->header.end());
+          buffer.push_back('\0');
+        }
+        buffer_offset = 0;
+        index.clear();
+      }
+
+      bool is_open(void) const
+      {
+        return file.is_open();
+      }
+
+      // where the container file is (logs put their zone maps here)
+      std::filesystem::path directory(void) const
+      {
+        return path.parent_path();
+      }
+
+      void write_block(uint16_t tag, const char* bytes, size_t size)
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        while (size > 0)
+        {
+          const uint32_t n = std::min<size_t>(size, UINT32_MAX);
+          append(buffer, tag);
+          append(buffer, n);
+          index.push_back(IndexEntry{ tag, buffer_offset + buffer.size(), n });
+          buffer.insert(buffer.end(), bytes, bytes + n);
+          bytes += n;
+          size -= n;
+          if (buffer.size() >= buffer_size)
+            write_buffer();
+        }
+      }
+
+      void close(void)
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!file.is_open())
+          return;
+        const uint64_t index_offset = buffer_offset + buffer.size();
+        for (auto& e : index)
+        {
+          append(buffer, e.tag);
+          append(buffer, e.offset);
+          append(buffer, e.size);
+          if (buffer.size() >= buffer_size)
+            write_buffer();
+        }
+        append(buffer, index_offset);
+        append(buffer, (uint32_t)index.size());
+        buffer.insert(buffer.end(), index_magic.begin(), index_magic.end());
+        write_buffer();
+        file.flush();
+        file.close();
+        index.clear();
+      }
+    };
+
     class Manager
     {
       std::filesystem::path root_directory;
@@ -523,6 +1319,14 @@ namespace BasicLog
       bool logging = false;
       std::chrono::system_clock::time_point start_time;
       std::chrono::system_clock::duration max_log_duration = std::chrono::hours(1);
+      bool use_container = false; // all logs in one file per segment
+      Container container;
+      bool use_flight_recorder = false; // logs stay in memory until trigger()
+      std::chrono::steady_clock::duration pre_trigger;
+      std::chrono::steady_clock::duration post_trigger;
+      size_t flight_recorder_memory = 0; // per log
+      std::filesystem::path capture_directory;
+      std::chrono::steady_clock::time_point capture_end;
       std::mutex lock;
 
       void pcheck_child_names(void) const
@@ -536,9 +1340,24 @@ namespace BasicLog
 
       std::filesystem::path pstart(void)
       {
+        if (logging) pstop(); // finish the current segment first
+        if (use_flight_recorder)
+        {
+          std::for_each(logs.begin(), logs.end(), [&](Log* L) { L->start_flight_recorder(pre_trigger, post_trigger, flight_recorder_memory); });
+          start_time = Log::now();
+          logging = true;
+          return root_directory; // nothing written until trigger()
+        }
         std::filesystem::path dir = root_directory / unix_time_formatted();
         std::filesystem::create_directories(dir);
-        std::for_each(logs.begin(), logs.end(), [&](Log* L) { L->start(dir); });
+        if (use_container)
+        {
+          container.open(dir / std::string("logs").append(Container::extension), logs);
+          for (size_t i = 0; i < logs.size(); i++)
+            logs[i]->start(container, (uint16_t)i);
+        }
+        else
+          std::for_each(logs.begin(), logs.end(), [&](Log* L) { L->start(dir); });
         start_time = Log::now();
         logging = true;
         return dir;
@@ -547,6 +1366,7 @@ namespace BasicLog
       void pstop(void)
       {
         std::for_each(logs.begin(), logs.end(), [](Log* L) { L->stop(); });
+        container.close();
         logging = false;
       }
 
@@ -563,6 +1383,12 @@ namespace BasicLog
         set_root_directory(root);
       }
 
+      // the logs have to outlive the manager (they're stopped here, which also closes the container they write into)
+      ~Manager()
+      {
+        stop();
+      }
+
       void push_back(Log* L)
       {
         lock.lock();
@@ -585,6 +1411,53 @@ namespace BasicLog
         lock.unlock();
       }
 
+      // write every log into a single container file per segment (instead of one file per log)
+      void set_container(bool Enable, size_t Block_size = 4096)
+      {
+        lock.lock();
+        bool was_logging = logging;
+        if (was_logging) pstop();
+        use_container = Enable;
+        container.block_size = Block_size;
+        if (was_logging) pstart();
+        lock.unlock();
+      }
+
+      // instead of writing to files keep the most recent rows of each log in memory (at most Memory bytes per log).
+      // trigger() then writes every log from Pre before to Post after the trigger
+      void set_flight_recorder(bool Enable, std::chrono::steady_clock::duration Pre = std::chrono::seconds(10), std::chrono::steady_clock::duration Post = std::chrono::seconds(2), size_t Memory = 64 << 20)
+      {
+        lock.lock();
+        bool was_logging = logging;
+        if (was_logging) pstop();
+        use_flight_recorder = Enable;
+        pre_trigger = Pre;
+        post_trigger = Post;
+        flight_recorder_memory = Memory;
+        if (was_logging) pstart();
+        lock.unlock();
+      }
+
+      // flight recorder: capture every log to root_directory/capture_{unix_time_formatted()}. triggers that arrive
+      // before the post trigger window of the previous one has passed go to the same directory
+      std::filesystem::path trigger(void)
+      {
+        lock.lock();
+        if (!logging || !use_flight_recorder)
+        {
+          lock.unlock();
+          return {};
+        }
+        auto t = std::chrono::steady_clock::now();
+        if (capture_directory.empty() || t > capture_end)
+          capture_directory = root_directory / ("capture_" + unix_time_formatted());
+        capture_end = t + post_trigger;
+        auto dir = capture_directory;
+        std::for_each(logs.begin(), logs.end(), [&](Log* L) { L->trigger(dir); }); // logs already capturing are left alone
+        lock.unlock();
+        return dir;
+      }
+
       void set_max_log_duration(const std::chrono::system_clock::duration& time)
       {
         lock.lock();
@@ -603,8 +1476,7 @@ namespace BasicLog
       void stop(void)
       {
         lock.lock();
-        std::for_each(logs.begin(), logs.end(), [](Log* L) { L->stop(); });
-        logging = false;
+        pstop();
         lock.unlock();
       }
 
@@ -615,7 +1487,7 @@ namespace BasicLog
       void restart_if_needed(void)
       {
         lock.lock();
-        if (logging)
+        if (logging && !use_flight_recorder)
         {
           if ((now() - start_time) >= max_log_duration)
             pstart();
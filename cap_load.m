@@ -33,47 +33,31 @@ result_names = {};
 
 exclude_incomplete_rows = pop(varargin, 'exclude_incomplete_rows', true);
 warn_on_multiple = pop(varargin, 'warn_on_multiple', false);
+use_mex = pop(varargin, 'use_mex', exist('cap_load_mex', 'file') == 3); % the compiled decoder (cap_load_mex.cpp) if it's been built
 
 % for each file
 for i = 1:numel(d)
 
-    % load the entire contents of the file
     fn = fullfile(d(i).folder,d(i).name);
-    fid = fopen(fn, 'r');
-    assert(fid ~= -1, ['unable to open ' fn]);
-    [raw_Bytes, count] = fread(fid,'uint8=>uint8');
-    fclose(fid);
-
-    if count == 0
-        warning('File contains zero content: %s', fn);
-        continue;
-    end
-
-    % extract the header
-    fz = find(raw_Bytes==0, 1); % the first zero is the end of the header string
-    try
-        header = jsondecode(char(raw_Bytes(1:(fz-1)))');
-    catch
-        warning('failed to load: %s\n', fn);
-        continue;
-    end
-
-    % separate the data from the header
-    raw_Bytes = raw_Bytes((fz+1):end);
-
-    % put the data in a struct format specified by the header
-    switch header.compression
-        case 'RAW'
-            Bytes = fix_shape(raw_Bytes, header.row_size, exclude_incomplete_rows);
-        case 'DIFF1'
-            Bytes = expand_DIFF1(raw_Bytes, header.row_size, exclude_incomplete_rows);
-        otherwise
-            error(['unexpected compression method: ' header.compression]);
+    if use_mex
+        % decoded straight into a typed array per entry (always excludes incomplete rows)
+        try
+            [header_text, offsets, cols, nrows, count] = cap_load_mex(fn);
+            header = jsondecode(header_text);
+        catch err
+            warning('failed to load: %s (%s)\n', fn, err.message);
+            continue;
+        end
+        ratio = nrows*header.row_size/count;
+        columns = containers.Map(num2cell(offsets), cols);
+        [data_i, info_i] = extract(header.data_header, [], columns);
+    else
+        [data_i, info_i, ratio] = load_file(fn, exclude_incomplete_rows);
+        if isempty(data_i)
+            continue;
+        end
     end
 
-    ratio = numel(Bytes)/count; % size of the stuff we care about over the size of the file
-    [data_i, info_i] = extract(header.data_header, Bytes);
-
     % do some checks on the format
     datafn = fieldnames(data_i);
     assert(numel(datafn) == 1, 'expecting a single field at the highest level');
@@ -105,6 +89,118 @@ end
 info.lookup = info_lookup(info);
 end
 
+function [data_i, info_i, ratio] = load_file(fn, exclude_incomplete_rows)
+% the plain matlab decoder
+data_i = [];
+info_i = [];
+ratio = [];
+
+% load the entire contents of the file
+fid = fopen(fn, 'r');
+assert(fid ~= -1, ['unable to open ' fn]);
+[raw_Bytes, count] = fread(fid,'uint8=>uint8');
+fclose(fid);
+
+if count == 0
+    warning('File contains zero content: %s', fn);
+    return;
+end
+
+% extract the header
+fz = find(raw_Bytes==0, 1); % the first zero is the end of the header string
+try
+    header = jsondecode(char(raw_Bytes(1:(fz-1)))');
+catch
+    warning('failed to load: %s\n', fn);
+    return;
+end
+
+% separate the data from the header
+raw_Bytes = raw_Bytes((fz+1):end);
+
+% put the data in a struct format specified by the header
+if isfield(header, 'block_rows')
+    Bytes = expand_blocks(raw_Bytes, header, exclude_incomplete_rows);
+else
+    Bytes = expand(raw_Bytes, header.compression, header.row_size, exclude_incomplete_rows);
+end
+
+ratio = numel(Bytes)/count; % size of the stuff we care about over the size of the file
+[data_i, info_i] = extract(header.data_header, Bytes, []);
+end
+
+function Bytes = expand(raw_Bytes, method, cols, exclude_incomplete_rows)
+% decode rows that were all written with the same method
+switch method
+    case 'RAW'
+        Bytes = fix_shape(raw_Bytes, cols, exclude_incomplete_rows);
+    case 'DIFF1'
+        Bytes = expand_DIFF1(raw_Bytes, cols, exclude_incomplete_rows);
+    case 'DIFF2'
+        Bytes = expand_DIFF2(raw_Bytes, cols);
+    otherwise
+        error(['unexpected compression method: ' method]);
+end
+end
+
+function Bytes = expand_blocks(raw_Bytes, header, exclude_incomplete_rows)
+% a block is: codec index (uint8), row count (uint32), byte count (uint32), encoded rows
+codecs = cellstr(header.codecs);
+if isfield(header, 'framing')
+    Bytes = expand_framed_blocks(raw_Bytes, header, codecs, exclude_incomplete_rows);
+    return;
+end
+parts = {zeros(0, header.row_size, 'uint8')};
+pos = 0;
+nBytes = numel(raw_Bytes);
+while (nBytes-pos) >= 9
+    index = double(raw_Bytes(pos+1)) + 1;
+    count = double(typecast(raw_Bytes(pos+(6:9)), 'uint32'));
+    pos = pos + 9;
+    last = min(pos+count, nBytes);
+    parts{end+1} = expand(raw_Bytes((pos+1):last), codecs{index}, header.row_size, exclude_incomplete_rows); %#ok<AGROW>
+    pos = last;
+end
+Bytes = vertcat(parts{:});
+end
+
+function Bytes = expand_framed_blocks(raw_Bytes, header, codecs, exclude_incomplete_rows)
+% framed blocks start with a marker and have a crc32c after the byte count (see Log::set_framing)
+% the crc isn't checked here (cap_load_mex does) but blocks are found by their marker so damage doesn't spread
+% and a block that doesn't decode to the number of rows in its header is left out
+marker = uint8([137 'CAPBLK' 26])';
+starts = strfind(char(raw_Bytes'), char(marker')) - 1; % every possible block
+parts = {zeros(0, header.row_size, 'uint8')};
+nBytes = numel(raw_Bytes);
+next = 0; % where the next block should be
+for pos = starts
+    if pos < next || (nBytes-pos) < 21
+        continue; % inside the previous block
+    end
+    index = double(raw_Bytes(pos+9)) + 1;
+    rows = double(typecast(raw_Bytes(pos+(10:13)), 'uint32'));
+    count = double(typecast(raw_Bytes(pos+(14:17)), 'uint32'));
+    if index > numel(codecs) || pos+21+count > nBytes
+        continue;
+    end
+    try
+        block = expand(raw_Bytes(pos+21+(1:count)), codecs{index}, header.row_size, exclude_incomplete_rows);
+    catch
+        block = [];
+    end
+    if size(block,1) ~= rows
+        % damaged (its byte count can't be trusted either so the markers inside it are still looked at)
+        continue;
+    end
+    if pos > next
+        warning('skipped %d damaged bytes', pos - next);
+    end
+    parts{end+1} = block; %#ok<AGROW>
+    next = pos+21+count;
+end
+Bytes = vertcat(parts{:});
+end
+
 function Bytes = fix_shape(Bytes,cols,exclude_incomplete_rows)
 % first get the Bytes in the correct shape
 count = numel(Bytes);
@@ -140,12 +236,16 @@ function find_fun = info_lookup(info)
     find_fun = @lookup;
 end
 
-function [data, info] = extract(header, Bytes)
+function [data, info] = extract(header, Bytes, columns)
 % given the header specification, extract data from the byte array
+% (or from columns: a map of byte offset -> already converted data when using cap_load_mex)
 % allowed data types
 type_names = {'uint8',	'int8',	'uint16',	'int16',	'uint32',	'int32',	'uint64',	'int64',	'float32',	'float64',  'bool',	'char'};
 matlab_names={'uint8',	'int8',	'uint16',	'int16',	'uint32',	'int32',	'uint64',	'int64',	 'single',	 'double',  'bool',	'char'};
 type_sizes = [      1,       1,        2,         2,           4,         4,           8,         8,            4,          8,       1,      1];
+% floating point values can be stored with less precision (see Log::Entry::store_as)
+storage_names = {'float32', 'float16', 'bfloat16', 'int8', 'int16', 'int32'};
+storage_sizes = [        4,         2,          2,      1,       2,       4];
 
 % closure. returns a function that does the convertion for 'type_name'
     function c = basic_converter(type_name)
@@ -189,7 +289,7 @@ converter{end+1} = @(bytes, count) char(converter{2}(bytes,count));
         info = find_children_of('');
     end
 
-    function data = extract_data(header, Bytes, data, index)
+    function data = extract_data(header, Bytes, data, index, base_offset)
         n = numel(header);
 
         hi = 0;
@@ -207,11 +307,23 @@ converter{end+1} = @(bytes, count) char(converter{2}(bytes,count));
             type_loc = strcmpi(type_names, header(hi).type);
             if any(type_loc)
                 % it's a fundamental (arrays are contiguous)
-                num_bytes = type_sizes(type_loc)*header(hi).count;
+                storage = stored_as(header(hi));
+                if isempty(storage)
+                    num_bytes = type_sizes(type_loc)*header(hi).count;
+                else
+                    num_bytes = storage_sizes(strcmpi(storage_names, storage))*header(hi).count;
+                end
                 rng = (1:num_bytes) + byte_offset;
 
                 % add to the data struct
-                data = setfield(data, qualified_name{1:(end-1)}, {index}, qualified_name{end}, converter{type_loc}(Bytes(:,rng),header(hi).count));
+                if isempty(columns) && isempty(storage)
+                    value = converter{type_loc}(Bytes(:,rng),header(hi).count);
+                elseif isempty(columns)
+                    value = restore(Bytes(:,rng), header(hi), matlab_names{type_loc});
+                else
+                    value = columns(base_offset + byte_offset);
+                end
+                data = setfield(data, qualified_name{1:(end-1)}, {index}, qualified_name{end}, value);
                 byte_offset = byte_offset + num_bytes;
                 continue;
             end
@@ -243,7 +355,11 @@ converter{end+1} = @(bytes, count) char(converter{2}(bytes,count));
             % recurse through the list of children and expand each one out
             for i = 1:header(pi).count
                 rng = (1:size) + byte_offset;
-                data = extract_data(all_children, Bytes(:,rng), data, i);
+                if isempty(columns)
+                    data = extract_data(all_children, Bytes(:,rng), data, i, base_offset + byte_offset);
+                else
+                    data = extract_data(all_children, [], data, i, base_offset + byte_offset);
+                end
                 byte_offset = byte_offset + size;
             end
         end
@@ -268,7 +384,7 @@ converter{end+1} = @(bytes, count) char(converter{2}(bytes,count));
         end
     end
 
-data = extract_data(header,Bytes,struct,1);
+data = extract_data(header,Bytes,struct,1,0);
 info = extract_description(header);
 [data, info] = order_children(data, info);
 info = rmfield(info,'ind');
@@ -315,6 +431,9 @@ while (nBytes-pos) >= num_bits
     % matlab can't add integers properly (with overflow) so...do this instead
     row = uint8(mod(int16(row) + int16(previous_row), uint8_max_plus_1));
     eB_count = eB_count + 1;
+    if eB_count > size(expanded_Bytes,2)
+        expanded_Bytes(cols, max(eB_count, 2*size(expanded_Bytes,2))) = 0;
+    end
     expanded_Bytes(:,eB_count) = row; % this will grow as needed if expanded_Bytes is too small. The performance is acceptable too IF you're operating on columns
 
     % expanded_Bytes = [expanded_Bytes; row];
@@ -326,6 +445,168 @@ end
 expanded_Bytes = expanded_Bytes';
 end
 
+function expanded_Bytes = expand_DIFF2(Bytes, cols)
+% each token is one of:
+% 0 (REPEAT): the previous row again (varint count, at most 4096) times
+% 1 (BITMAP): a bit per 64 byte region, a bit per byte of each region that changed, the changes
+% 2 (POSITIONS): number of changes (varint) then for each: bytes skipped since the last one (varint), the change
+% incomplete rows are always excluded
+num_regions = ceil(cols/64);
+l1_bytes = ceil(num_regions/8);
+region_bytes = ceil(min(64, cols - (0:(num_regions-1))*64)/8);
+
+uint8_max_plus_1 = int16(intmax('uint8')) + 1;
+
+previous_row = zeros(cols,1,'uint8');
+
+pos = 0;
+eB_count = 0;
+nBytes = numel(Bytes);
+% transposed for the same reason as expand_DIFF1. a guess at the number of rows, grown as needed
+expanded_Bytes = zeros(cols,floor(nBytes/cols)*3,'uint8');
+
+while pos < nBytes
+    token = Bytes(pos+1);
+    pos = pos + 1;
+    delta = zeros(cols,1,'uint8');
+    complete = true;
+    switch token
+        case 0
+            [n, pos, complete] = read_varint(Bytes, pos);
+            if ~complete
+                break;
+            end
+            if n > 4096
+                error('DIFF2: too many repeated rows');
+            end
+            if eB_count + n > size(expanded_Bytes,2)
+                % REPEATs can be far more rows than the estimate so grow geometrically
+                expanded_Bytes(cols, max(eB_count + n, 2*size(expanded_Bytes,2))) = 0;
+            end
+            expanded_Bytes(:,eB_count+(1:n)) = repmat(previous_row,1,n);
+            eB_count = eB_count + n;
+            continue;
+        case 1
+            if (nBytes-pos) < l1_bytes
+                break;
+            end
+            l1 = bits_of(Bytes(pos+(1:l1_bytes)));
+            pos = pos + l1_bytes;
+            changed = false(cols,1);
+            for r = find(l1(1:num_regions))'
+                nb = region_bytes(r);
+                if (nBytes-pos) < nb
+                    complete = false;
+                    break;
+                end
+                l2 = bits_of(Bytes(pos+(1:nb)));
+                pos = pos + nb;
+                ind = (r-1)*64 + (1:nb*8)';
+                keep = ind <= cols;
+                changed(ind(keep)) = l2(keep);
+            end
+            count = sum(changed);
+            if ~complete || (nBytes-pos) < count
+                break;
+            end
+            delta(changed) = Bytes(pos+(1:count));
+            pos = pos + count;
+        case 2
+            [count, pos, complete] = read_varint(Bytes, pos);
+            i = -1;
+            for k = 1:count
+                [gap, pos, complete] = read_varint(Bytes, pos);
+                if ~complete || pos >= nBytes
+                    complete = false;
+                    break;
+                end
+                i = i + gap + 1;
+                delta(i+1) = Bytes(pos+1);
+                pos = pos + 1;
+            end
+            if ~complete
+                break;
+            end
+        otherwise
+            error('DIFF2: unexpected token %d', token);
+    end
+
+    % matlab can't add integers properly (with overflow) so...do this instead
+    row = uint8(mod(int16(delta) + int16(previous_row), uint8_max_plus_1));
+    eB_count = eB_count + 1;
+    expanded_Bytes(:,eB_count) = row;
+    previous_row = row;
+end
+if eB_count < size(expanded_Bytes,2)
+    expanded_Bytes = expanded_Bytes(:,1:eB_count);
+end
+expanded_Bytes = expanded_Bytes';
+end
+
+function storage = stored_as(h)
+% older files don't have a storage field
+storage = '';
+if isfield(h, 'storage')
+    storage = h.storage;
+end
+end
+
+function value = restore(bytes, h, matlab_type)
+% convert a fundamental stored with less precision back to its type
+raw = reshape(bytes', [], 1);
+switch h.storage
+    case 'float32'
+        value = double(typecast(raw, 'single'));
+    case 'float16'
+        value = half_to_double(typecast(raw, 'uint16'));
+    case 'bfloat16'
+        value = double(typecast(bitshift(uint32(typecast(raw, 'uint16')), 16), 'single'));
+    case {'int8', 'int16', 'int32'}
+        stored = typecast(raw, h.storage);
+        value = double(stored)*h.scale + h.offset;
+        value(stored == intmin(h.storage)) = NaN; % reserved for nan
+    otherwise
+        error('"%s" is stored as unknown "%s"', h.name, h.storage);
+end
+value = reshape(cast(value, matlab_type), h.count, [])';
+end
+
+function value = half_to_double(h)
+h = double(h);
+s = 1 - 2*(h >= 32768);
+e = bitand(floor(h/1024), 31);
+m = bitand(h, 1023);
+value = s .* 2.^(e - 15) .* (1 + m/1024);
+subnormal = e == 0;
+value(subnormal) = s(subnormal) .* 2^-14 .* m(subnormal)/1024;
+value(e == 31 & m == 0) = s(e == 31 & m == 0) * Inf;
+value(e == 31 & m ~= 0) = NaN;
+end
+
+function [value, pos, complete] = read_varint(Bytes, pos)
+% little endian base 128
+value = 0;
+shift = 0;
+complete = false;
+while pos < numel(Bytes)
+    b = double(Bytes(pos+1));
+    pos = pos + 1;
+    value = value + bitand(b,127) * 2^shift;
+    shift = shift + 7;
+    if b < 128
+        complete = true;
+        return;
+    end
+end
+end
+
+function bits = bits_of(bytes)
+% logical vector with the bits of each byte (least significant first)
+n = numel(bytes);
+bits = logical(bitget(repmat(bytes(:)',8,1), repmat((1:8)',1,n)));
+bits = bits(:);
+end
+
 function [value, args] = pop(args, name, default)
 % pop a name, value pair out of args if it exists otherwise return default
 
@@ -0,0 +1,176 @@
+// cap_load_mex: decode a .cap file for cap_load.m (which falls back to plain matlab when this isn't built)
+//
+// [header, offsets, columns, rows, file_bytes] = cap_load_mex(file_name)
+//   header:     the json header (char)
+//   offsets:    byte offset (within a row) of every fundamental entry. struct arrays have one per element
+//   columns:    cell array with a rows x count array of the entry's type for each offset
+//   rows:       number of complete rows
+//   file_bytes: size of the file
+//
+// build (from matlab): mex -R2018a CXXFLAGS='$CXXFLAGS -std=c++20 -O2 -march=native' -I. cap_load_mex.cpp
+#include "mex.h"
+#include <cstdio>
+
+#include "cap_reader.hpp"
+
+namespace
+{
+  mxClassID class_of(const std::string& type)
+  {
+    if (type == "float64") return mxDOUBLE_CLASS;
+    if (type == "float32") return mxSINGLE_CLASS;
+    if (type == "bool") return mxLOGICAL_CLASS;
+    if (type == "char") return mxCHAR_CLASS;
+    if (type == "int8") return mxINT8_CLASS;
+    if (type == "int16") return mxINT16_CLASS;
+    if (type == "int32") return mxINT32_CLASS;
+    if (type == "int64") return mxINT64_CLASS;
+    if (type == "uint8") return mxUINT8_CLASS;
+    if (type == "uint16") return mxUINT16_CLASS;
+    if (type == "uint32") return mxUINT32_CLASS;
+    if (type == "uint64") return mxUINT64_CLASS;
+    throw std::runtime_error("unexpected type: " + type);
+  }
+
+  // copy one entry out of the (row major) rows into a column major rows x count array
+  // (column_stride is the number of rows in 'out' when only part of it is being filled in)
+  template <typename In, typename Out = In>
+  void scatter(const char* rows, size_t num_rows, size_t row_size, size_t offset, size_t count, Out* out, size_t column_stride = 0)
+  {
+    if (column_stride == 0)
+      column_stride = num_rows;
+    for (size_t r = 0; r < num_rows; r++)
+    {
+      const char* src = rows + r * row_size + offset;
+      for (size_t c = 0; c < count; c++)
+      {
+        In value;
+        std::memcpy(&value, src + c * sizeof(In), sizeof(In));
+        out[c * column_stride + r] = (Out)value;
+      }
+    }
+  }
+
+  // a rows x count array for one instance of a field
+  mxArray* create_column(const BasicLog::Reader::Field& f, size_t rows)
+  {
+    const mxClassID id = class_of(f.type);
+    if (id == mxCHAR_CLASS)
+    {
+      mwSize dims[2] = { rows, f.count };
+      return mxCreateCharArray(2, dims);
+    }
+    if (id == mxLOGICAL_CLASS)
+      return mxCreateLogicalMatrix(rows, f.count);
+    return mxCreateNumericMatrix(rows, f.count, id, mxREAL);
+  }
+
+  // fill in rows [first, first + reader.rows(rows)) of a column from create_column
+  void fill_column(const BasicLog::Reader& reader, const BasicLog::Reader::Field& f, size_t offset, std::string_view rows, size_t first, mxArray* a)
+  {
+    const size_t n = reader.rows(rows);
+    const size_t stride = mxGetM(a);
+    const mxClassID id = mxGetClassID(a);
+    void* out = mxGetData(a);
+    if (f.storage != BasicLog::Storage::none)
+    {
+      // stored with less precision. restore one row at a time then scatter it
+      std::vector<char> values(f.count * f.type_size);
+      for (size_t r = 0; r < n; r++)
+      {
+        BasicLog::Reader::restore(f, rows.data() + r * reader.row_size + offset, values.data());
+        if (id == mxDOUBLE_CLASS)
+          scatter<double>(values.data(), 1, 0, 0, f.count, (double*)out + first + r, stride);
+        else
+          scatter<float>(values.data(), 1, 0, 0, f.count, (float*)out + first + r, stride);
+      }
+      return;
+    }
+    switch (f.type_size)
+    {
+    case 1:
+      if (id == mxCHAR_CLASS)
+        scatter<unsigned char, mxChar>(rows.data(), n, reader.row_size, offset, f.count, (mxChar*)out + first, stride);
+      else
+        scatter<uint8_t>(rows.data(), n, reader.row_size, offset, f.count, (uint8_t*)out + first, stride);
+      break;
+    case 2: scatter<uint16_t>(rows.data(), n, reader.row_size, offset, f.count, (uint16_t*)out + first, stride); break;
+    case 4: scatter<uint32_t>(rows.data(), n, reader.row_size, offset, f.count, (uint32_t*)out + first, stride); break;
+    case 8: scatter<uint64_t>(rows.data(), n, reader.row_size, offset, f.count, (uint64_t*)out + first, stride); break;
+    }
+  }
+
+  // drop the rows of a column from 'rows' on (when fewer rows decoded than count_rows() expected)
+  void shrink_column(mxArray* a, size_t rows)
+  {
+    const size_t stride = mxGetM(a);
+    if (rows == stride)
+      return;
+    const size_t element_size = mxGetElementSize(a);
+    char* data = (char*)mxGetData(a);
+    for (size_t c = 1; c < mxGetN(a); c++)
+      std::memmove(data + c * rows * element_size, data + c * stride * element_size, rows * element_size);
+    mxSetM(a, rows);
+  }
+}
+
+void mexFunction(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+  if (nrhs != 1 || !mxIsChar(prhs[0]))
+    mexErrMsgIdAndTxt("cap_load_mex:usage", "usage: [header, offsets, columns, rows, file_bytes] = cap_load_mex(file_name)");
+
+  // mexErrMsgIdAndTxt doesn't return (or run destructors) so only call it once everything is cleaned up
+  char message[1024] = "";
+  char* name = mxArrayToString(prhs[0]);
+  try
+  {
+    BasicLog::Reader reader{ std::filesystem::path(name) }; // mmap'd
+
+    // the columns are allocated up front then filled in a batch of rows at a time (never all the rows at once)
+    const size_t capacity = reader.count_rows();
+    size_t n = 0;
+    for (auto& f : reader.fields)
+      n += f.offsets.size();
+    mxArray* offsets = mxCreateDoubleMatrix(1, n, mxREAL);
+    mxArray* columns = mxCreateCellMatrix(1, n);
+    size_t k = 0;
+    for (auto& f : reader.fields)
+    {
+      for (size_t o : f.offsets)
+      {
+        mxGetDoubles(offsets)[k] = (double)o;
+        mxSetCell(columns, k, create_column(f, capacity));
+        k++;
+      }
+    }
+
+    size_t num_rows = 0, damaged = 0;
+    reader.decode_batches(std::max<size_t>((1 << 20) / reader.row_size, 1), [&](std::string_view rows) {
+      rows = rows.substr(0, std::min(reader.rows(rows), capacity - num_rows) * reader.row_size);
+      size_t k = 0;
+      for (auto& f : reader.fields)
+      {
+        for (size_t o : f.offsets)
+          fill_column(reader, f, o, rows, num_rows, mxGetCell(columns, k++));
+      }
+      num_rows += reader.rows(rows);
+    }, &damaged);
+    for (size_t k = 0; k < n; k++)
+      shrink_column(mxGetCell(columns, k), num_rows);
+    if (damaged)
+      mexWarnMsgIdAndTxt("cap_load_mex:damaged", "%s: skipped %zu damaged blocks", name, damaged);
+
+    plhs[0] = mxCreateString(std::string(reader.header_text).c_str());
+    if (nlhs > 1) plhs[1] = offsets; else mxDestroyArray(offsets);
+    if (nlhs > 2) plhs[2] = columns; else mxDestroyArray(columns);
+    if (nlhs > 3) plhs[3] = mxCreateDoubleScalar((double)num_rows);
+    if (nlhs > 4) plhs[4] = mxCreateDoubleScalar((double)std::filesystem::file_size(name));
+  }
+  catch (const std::exception& e)
+  {
+    std::snprintf(message, sizeof(message), "%s: %s", name, e.what());
+  }
+  mxFree(name);
+  if (message[0])
+    mexErrMsgIdAndTxt("cap_load_mex:decode", "%s", message);
+}
@@ -0,0 +1,1167 @@
+#pragma once
+#include <string_view>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <future>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "type_name.hpp"
+#include "codec.hpp"
+#include "storage.hpp"
+#include "crc32c.hpp"
+#include "zone_map.hpp"
+
+namespace BasicLog
+{
+  // just enough json to read a .cap header back in
+  struct Json
+  {
+    enum Kind
+    {
+      Null,
+      Bool,
+      Number,
+      String,
+      Array,
+      Object
+    };
+
+    Kind kind = Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> array;
+    std::vector<std::pair<std::string, Json>> object;
+
+    Json const* find(const std::string_view key) const
+    {
+      for (auto& kv : object)
+      {
+        if (kv.first == key)
+          return &kv.second;
+      }
+      return nullptr;
+    }
+
+    Json const& operator[](const std::string_view key) const
+    {
+      auto value = find(key);
+      if (!value)
+        throw std::runtime_error(std::string("json: missing \"").append(key).append("\""));
+      return *value;
+    }
+
+    static Json parse(const std::string_view text)
+    {
+      size_t pos = 0;
+      Json j = parse_value(text, pos);
+      skip_space(text, pos);
+      if (pos != text.size())
+        throw error("unexpected trailing characters", pos);
+      return j;
+    }
+
+  private:
+    static std::runtime_error error(const std::string_view msg, size_t pos)
+    {
+      return std::runtime_error(std::string("json: ").append(msg).append(" at ").append(std::to_string(pos)));
+    }
+
+    static void skip_space(const std::string_view t, size_t& pos)
+    {
+      while (pos < t.size() && std::isspace((unsigned char)t[pos]))
+        pos++;
+    }
+
+    static void expect(const std::string_view t, size_t& pos, char c)
+    {
+      skip_space(t, pos);
+      if (pos >= t.size() || t[pos] != c)
+        throw error(std::string("expected '").append(1, c).append("'"), pos);
+      pos++;
+    }
+
+    static std::string parse_string(const std::string_view t, size_t& pos)
+    {
+      expect(t, pos, '"');
+      std::string s;
+      while (pos < t.size() && t[pos] != '"')
+      {
+        char c = t[pos++];
+        if (c != '\\')
+        {
+          s.push_back(c);
+          continue;
+        }
+        if (pos >= t.size())
+          break;
+        c = t[pos++];
+        switch (c)
+        {
+        case 'n': s.push_back('\n'); break;
+        case 't': s.push_back('\t'); break;
+        case 'r': s.push_back('\r'); break;
+        case 'b': s.push_back('\b'); break;
+        case 'f': s.push_back('\f'); break;
+        case 'u':
+          // the writer never produces these. keep ascii, replace everything else
+          if (pos + 4 > t.size())
+            throw error("bad escape", pos);
+          c = (char)std::strtol(std::string(t.substr(pos, 4)).c_str(), nullptr, 16);
+          s.push_back((unsigned char)c < 0x80 ? c : '?');
+          pos += 4;
+          break;
+        default: s.push_back(c); break; // \" \\ \/
+        }
+      }
+      if (pos >= t.size())
+        throw error("unterminated string", pos);
+      pos++;
+      return s;
+    }
+
+    static Json parse_value(const std::string_view t, size_t& pos)
+    {
+      skip_space(t, pos);
+      if (pos >= t.size())
+        throw error("unexpected end", pos);
+      Json j;
+      const char c = t[pos];
+      if (c == '{')
+      {
+        j.kind = Object;
+        pos++;
+        skip_space(t, pos);
+        if (pos < t.size() && t[pos] == '}')
+        {
+          pos++;
+          return j;
+        }
+        while (true)
+        {
+          skip_space(t, pos);
+          std::string key = parse_string(t, pos);
+          expect(t, pos, ':');
+          j.object.emplace_back(std::move(key), parse_value(t, pos));
+          skip_space(t, pos);
+          if (pos < t.size() && t[pos] == ',')
+          {
+            pos++;
+            continue;
+          }
+          expect(t, pos, '}');
+          return j;
+        }
+      }
+      if (c == '[')
+      {
+        j.kind = Array;
+        pos++;
+        skip_space(t, pos);
+        if (pos < t.size() && t[pos] == ']')
+        {
+          pos++;
+          return j;
+        }
+        while (true)
+        {
+          j.array.push_back(parse_value(t, pos));
+          skip_space(t, pos);
+          if (pos < t.size() && t[pos] == ',')
+          {
+            pos++;
+            continue;
+          }
+          expect(t, pos, ']');
+          return j;
+        }
+      }
+      if (c == '"')
+      {
+        j.kind = String;
+        j.string = parse_string(t, pos);
+        return j;
+      }
+      if (t.substr(pos, 4) == "true" || t.substr(pos, 5) == "false")
+      {
+        j.kind = Bool;
+        j.boolean = t[pos] == 't';
+        pos += j.boolean ? 4 : 5;
+        return j;
+      }
+      if (t.substr(pos, 4) == "null")
+      {
+        pos += 4;
+        return j;
+      }
+      // number
+      size_t end = pos;
+      while (end < t.size() && std::strchr("+-0123456789.eE", t[end]))
+        end++;
+      if (end == pos)
+        throw error("unexpected character", pos);
+      j.kind = Number;
+      j.number = std::strtod(std::string(t.substr(pos, end - pos)).c_str(), nullptr);
+      pos = end;
+      return j;
+    }
+  };
+
+  // read only view of an entire file
+  class MappedFile
+  {
+    const char* ptr = nullptr;
+    size_t length = 0;
+
+    void unmap(void)
+    {
+      if (ptr)
+        munmap((void*)ptr, length);
+      ptr = nullptr;
+      length = 0;
+    }
+
+  public:
+    MappedFile() { }
+
+    MappedFile(const std::filesystem::path& path)
+    {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd == -1)
+        throw std::runtime_error(std::string("unable to open ").append(path));
+      struct stat st;
+      if (fstat(fd, &st) != 0)
+      {
+        ::close(fd);
+        throw std::runtime_error(std::string("unable to stat ").append(path));
+      }
+      length = st.st_size;
+      if (length > 0)
+      {
+        void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+          ::close(fd);
+          throw std::runtime_error(std::string("unable to map ").append(path));
+        }
+        madvise(p, length, MADV_SEQUENTIAL);
+        ptr = (const char*)p;
+      }
+      ::close(fd); // the mapping keeps the file alive
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+      : ptr(other.ptr), length(other.length)
+    {
+      other.ptr = nullptr;
+      other.length = 0;
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+      unmap();
+      std::swap(ptr, other.ptr);
+      std::swap(length, other.length);
+      return *this;
+    }
+
+    ~MappedFile()
+    {
+      unmap();
+    }
+
+    const char* data() const
+    {
+      return ptr;
+    }
+
+    size_t size() const
+    {
+      return length;
+    }
+
+    std::string_view view() const
+    {
+      return std::string_view(ptr, length);
+    }
+
+    // drop the whole pages in [begin, end) from memory once they've been read (they're read from the file again if needed).
+    // returns where the last of them ends
+    size_t release(size_t begin, size_t end) const
+    {
+      const size_t page = sysconf(_SC_PAGESIZE);
+      begin = begin / page * page;
+      end = std::min(end, length) / page * page;
+      if (ptr && begin < end)
+        madvise((void*)(ptr + begin), end - begin, MADV_DONTNEED);
+      return std::max(begin, end);
+    }
+  };
+
+  // reads a zone map written by Log::set_zone_maps (see zone_map.hpp)
+  class ZoneMap
+  {
+  public:
+    struct Zone
+    {
+      uint64_t offset;   // of the block within the log's stream (Reader::body)
+      size_t rows;
+      size_t first_row;  // rows in the blocks before this one
+      const char* stats; // min, max (, sum) of each field
+    };
+
+    ZoneMap(const std::filesystem::path& path)
+      : file(path)
+    {
+      auto bytes = file.view();
+      const size_t end = bytes.find('\0');
+      if (end == std::string_view::npos)
+        throw std::runtime_error(std::string("no zone map header in ").append(path));
+      header = Json::parse(bytes.substr(0, end));
+      log = header["log"].string;
+      row_size = (size_t)header["row_size"].number;
+      sums = header["sums"].boolean;
+      for (auto& f : header["fields"].array)
+        fields.push_back(f["name"].string);
+      const size_t size = zone_map::record_size(fields.size(), sums);
+      size_t first_row = 0;
+      for (size_t pos = end + 1; bytes.size() - pos >= size; pos += size) // a partly written last record is ignored
+      {
+        Zone z{ 0, 0, first_row, bytes.data() + pos + zone_map::record_header_size };
+        uint32_t rows;
+        std::memcpy(&z.offset, bytes.data() + pos, sizeof(z.offset));
+        std::memcpy(&rows, bytes.data() + pos + 8, sizeof(rows));
+        z.rows = rows;
+        first_row += rows;
+        zones.push_back(z);
+      }
+    }
+
+    size_t field_index(const std::string_view name) const
+    {
+      auto f = std::find(fields.begin(), fields.end(), name);
+      if (f == fields.end())
+        throw std::runtime_error("the zone map of " + log + " has no field named " + std::string(name));
+      return f - fields.begin();
+    }
+
+    zone_map::Summary summary(const Zone& z, size_t field) const
+    {
+      double v[3] = {};
+      std::memcpy(v, z.stats + field * (sums ? 3 : 2) * sizeof(double), (sums ? 3 : 2) * sizeof(double));
+      return zone_map::Summary{ v[0], v[1], v[2] };
+    }
+
+    // the zones that could have a value of 'field' in [lo, hi]
+    std::vector<size_t> find(const std::string_view field, double lo, double hi) const
+    {
+      const size_t f = field_index(field);
+      std::vector<size_t> result;
+      for (size_t i = 0; i < zones.size(); i++)
+      {
+        auto s = summary(zones[i], f);
+        if (s.max >= lo && s.min <= hi)
+          result.push_back(i);
+      }
+      return result;
+    }
+
+    Json header;
+    std::string log;
+    size_t row_size = 0;
+    bool sums = false;
+    std::vector<std::string> fields;
+    std::vector<Zone> zones; // one per block
+
+  private:
+    MappedFile file;
+  };
+
+  // reads what Log writes: a json header, a zero byte, then the encoded rows
+  class Reader
+  {
+  public:
+    // a fundamental entry of the header and where it lives in a row
+    struct Field
+    {
+      std::string name; // fully qualified
+      std::string type;
+      size_t type_size;
+      size_t count;                // elements per instance
+      std::vector<size_t> offsets; // byte offset of each instance within a row (struct arrays have more than one)
+      Storage storage = Storage::none; // floating point values stored with less precision (see Log::Entry::store_as)
+      double scale = 1.0;
+      double offset = 0.0;
+
+      // bytes per element in a row
+      size_t stored_size(void) const
+      {
+        return storage == Storage::none ? type_size : StorageSize[(int)storage];
+      }
+
+      // number of values per row
+      size_t elements(void) const
+      {
+        return count * offsets.size();
+      }
+
+      bool operator==(const Field&) const = default;
+    };
+
+    Reader() { }
+
+    Reader(const std::filesystem::path& path)
+      : file(path)
+    {
+      parse(file.view());
+    }
+
+    // something already in memory
+    Reader(const char* bytes, size_t size)
+    {
+      parse(std::string_view(bytes, size));
+    }
+
+    // something already in memory that the reader should hang on to (e.g. ContainerReader::stream)
+    Reader(std::vector<char> bytes)
+      : owned(std::move(bytes))
+    {
+      parse(std::string_view(owned.data(), owned.size()));
+    }
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    // a block of rows (streams written with block_rows in the header are a sequence of these)
+    struct Block
+    {
+      size_t offset; // of the encoded rows within body
+      size_t bytes;  // of encoded rows (may be less than written if the file was cut short)
+      size_t rows;
+      uint8_t codec;       // index into codecs
+      uint32_t crc = 0;    // as written (framed streams only)
+      bool intact = true;  // false once verify() finds the crc doesn't match (or the block was cut short)
+    };
+
+    bool is_blocked(void) const
+    {
+      return header.find("block_rows") != nullptr;
+    }
+
+    // blocks have a marker and a crc (see Log::set_framing)
+    bool is_framed(void) const
+    {
+      return header.find("framing") != nullptr;
+    }
+
+    // decode all the complete rows. the result is either a view of the file itself (RAW) or of 'storage'
+    // framed blocks that fail verification are left out (and counted in 'damaged_blocks')
+    std::string_view decode(std::vector<char>& storage, size_t* damaged_blocks = nullptr) const
+    {
+      if (damaged_blocks)
+        *damaged_blocks = 0;
+      if (compression == "RAW" && !is_blocked())
+        return body.substr(0, body.size() / row_size * row_size);
+      storage.clear();
+      storage.reserve(body.size()); // a guess
+      if (is_blocked())
+      {
+        std::vector<std::unique_ptr<Codec>> instances;
+        for (auto& c : codecs)
+          instances.push_back(CodecRegistry::make(c));
+        auto list = blocks();
+        if (is_framed())
+          verify(list);
+        for (auto& b : list)
+        {
+          if (b.intact)
+            decode_rows(*instances[b.codec], body.data() + b.offset, b.bytes, storage);
+          else if (damaged_blocks)
+            (*damaged_blocks)++;
+        }
+      }
+      else
+        decode_rows(*CodecRegistry::make(compression), body.data(), body.size(), storage);
+      return std::string_view(storage.data(), storage.size());
+    }
+
+    // decode() a batch at a time so the whole log never has to be in memory. 'use' is called with each batch of complete
+    // rows (batch_rows of them, give or take a block, the last one can be shorter). returns the number of rows
+    template <typename Use>
+    size_t decode_batches(size_t batch_rows, Use&& use, size_t* damaged_blocks = nullptr) const
+    {
+      if (damaged_blocks)
+        *damaged_blocks = 0;
+      const size_t batch_bytes = std::max<size_t>(batch_rows, 1) * row_size;
+      size_t total = 0;
+      if (compression == "RAW" && !is_blocked())
+      {
+        const size_t end = body.size() / row_size * row_size;
+        for (size_t pos = 0; pos < end; pos += batch_bytes)
+          use(body.substr(pos, std::min(batch_bytes, end - pos)));
+        return end / row_size;
+      }
+      std::vector<char> storage;
+      storage.reserve(batch_bytes);
+      auto flush = [&]() {
+        const size_t n = rows(std::string_view(storage.data(), storage.size()));
+        if (n == 0)
+          return;
+        use(std::string_view(storage.data(), n * row_size));
+        total += n;
+        storage.clear();
+      };
+      if (is_blocked())
+      {
+        std::vector<std::unique_ptr<Codec>> instances;
+        for (auto& c : codecs)
+          instances.push_back(CodecRegistry::make(c));
+        auto list = blocks();
+        if (is_framed())
+          verify(list);
+        for (auto& b : list)
+        {
+          if (b.intact)
+            decode_rows(*instances[b.codec], body.data() + b.offset, b.bytes, storage);
+          else if (damaged_blocks)
+            (*damaged_blocks)++;
+          if (storage.size() >= batch_bytes)
+            flush();
+        }
+      }
+      else
+      {
+        auto codec = CodecRegistry::make(compression);
+        codec->reset(row_size);
+        for (size_t pos = 0, n; pos < body.size(); pos += n)
+        {
+          n = codec->decode(body.data() + pos, body.size() - pos, storage);
+          if (n == 0)
+            break;
+          if (storage.size() >= batch_bytes)
+            flush();
+        }
+      }
+      flush();
+      return total;
+    }
+
+    // the number of rows decode() would return, without decoding them. RAW and blocked streams go by their size and block
+    // headers (so a block that was cut short is still counted in full)
+    size_t count_rows(void) const
+    {
+      if (compression == "RAW" && !is_blocked())
+        return body.size() / row_size;
+      if (is_blocked())
+      {
+        auto list = blocks();
+        if (is_framed())
+          verify(list);
+        size_t total = 0;
+        for (auto& b : list)
+        {
+          if (b.intact)
+            total += b.rows;
+        }
+        return total;
+      }
+      // anything else has its rows counted by the codec (DIFF1 and DIFF2 step over them without decoding)
+      auto codec = CodecRegistry::make(compression);
+      codec->reset(row_size);
+      size_t total = 0;
+      for (size_t pos = 0, n; pos < body.size(); pos += n)
+      {
+        n = codec->skip(body.data() + pos, body.size() - pos, row_size, total);
+        if (n == 0)
+          break;
+      }
+      return total;
+    }
+
+    // find all the blocks in body. framed streams are searched for the next marker whenever one isn't where it should be
+    // (what had to be skipped to find it is listed as blocks that aren't intact)
+    std::vector<Block> blocks(void) const
+    {
+      if (is_framed())
+        return framed_blocks();
+      std::vector<Block> result;
+      size_t pos = 0;
+      while (body.size() - pos >= block_format::header_size)
+      {
+        uint32_t rows, bytes;
+        std::memcpy(&rows, body.data() + pos + 1, sizeof(rows));
+        std::memcpy(&bytes, body.data() + pos + 5, sizeof(bytes));
+        Block b{ pos + block_format::header_size, std::min<size_t>(bytes, body.size() - pos - block_format::header_size), rows, (uint8_t)body[pos] };
+        if (b.codec >= codecs.size())
+          throw std::runtime_error("block " + std::to_string(result.size()) + " uses an unknown codec");
+        result.push_back(b);
+        pos = b.offset + b.bytes;
+      }
+      return result;
+    }
+
+    // the block starting at 'pos' in body (intact is false if it's obviously not a block)
+    Block block_at(size_t pos) const
+    {
+      const size_t header_size = is_framed() ? block_format::framed_header_size : block_format::header_size;
+      if (pos > body.size() || body.size() - pos < header_size)
+        return Block{ std::min(pos, body.size()), 0, 0, 0, 0, false };
+      const char* h = body.data() + pos;
+      bool intact = true;
+      if (is_framed())
+      {
+        intact = body.compare(pos, block_format::marker.size(), block_format::marker) == 0;
+        h += block_format::marker.size();
+      }
+      uint32_t rows, bytes, crc = 0;
+      std::memcpy(&rows, h + 1, sizeof(rows));
+      std::memcpy(&bytes, h + 5, sizeof(bytes));
+      if (is_framed())
+        std::memcpy(&crc, h + block_format::header_size, sizeof(crc));
+      const size_t offset = pos + header_size;
+      const size_t available = body.size() - offset;
+      intact = intact && (uint8_t)h[0] < codecs.size() && (!is_framed() || bytes <= available);
+      return Block{ offset, std::min<size_t>(bytes, available), rows, (uint8_t)h[0], crc, intact };
+    }
+
+    // decode only the blocks that (according to 'zones') could have a value of 'field' in [lo, hi]. the rows that are
+    // decoded are in zones.find(field, lo, hi) order (each zone's first_row says where its rows were in the log)
+    std::string_view decode_where(const ZoneMap& zones, const std::string_view field, double lo, double hi, std::vector<char>& storage, size_t* damaged_blocks = nullptr) const
+    {
+      if (!is_blocked())
+        throw std::runtime_error("zone maps need a log written in blocks");
+      if (zones.row_size != row_size)
+        throw std::runtime_error("zone map doesn't match the log (row size " + std::to_string(zones.row_size) + " vs " + std::to_string(row_size) + ")");
+      std::vector<Block> list;
+      for (size_t z : zones.find(field, lo, hi))
+        list.push_back(block_at(zones.zones[z].offset));
+      if (is_framed())
+        verify(list);
+      std::vector<std::unique_ptr<Codec>> instances;
+      for (auto& c : codecs)
+        instances.push_back(CodecRegistry::make(c));
+      storage.clear();
+      if (damaged_blocks)
+        *damaged_blocks = 0;
+      for (auto& b : list)
+      {
+        if (b.intact)
+          decode_rows(*instances[b.codec], body.data() + b.offset, b.bytes, storage);
+        else if (damaged_blocks)
+          (*damaged_blocks)++;
+      }
+      return std::string_view(storage.data(), storage.size());
+    }
+
+    // check the crc of framed blocks ('threads' at a time, 0 for one per core)
+    void verify(std::vector<Block>& list, size_t threads = 0) const
+    {
+      if (threads == 0)
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+      auto check = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+          auto& b = list[i];
+          b.intact = b.intact && crc_matches(b);
+        }
+      };
+      const size_t per_thread = (list.size() + threads - 1) / threads;
+      std::vector<std::future<void>> running;
+      for (size_t begin = 0; begin < list.size(); begin += per_thread)
+        running.push_back(std::async(std::launch::async, check, begin, std::min(begin + per_thread, list.size())));
+      for (auto& r : running)
+        r.get();
+    }
+
+    // decode a run of rows that were encoded one after another with 'codec'. incomplete trailing rows are dropped
+    void decode_rows(Codec& codec, const char* in, size_t size, std::vector<char>& rows) const
+    {
+      codec.reset(row_size);
+      size_t pos = 0;
+      while (pos < size)
+      {
+        size_t n = codec.decode(in + pos, size - pos, rows);
+        if (n == 0)
+          break;
+        pos += n;
+      }
+    }
+
+    size_t rows(const std::string_view decoded) const
+    {
+      return decoded.size() / row_size;
+    }
+
+    // copy one field out of the decoded rows. 'column' needs room for rows * f.elements() values (of f.type)
+    void extract(const Field& f, const std::string_view decoded, char* column) const
+    {
+      const size_t num_rows = rows(decoded);
+      const char* row = decoded.data();
+      if (f.storage != Storage::none)
+      {
+        for (size_t r = 0; r < num_rows; r++, row += row_size)
+        {
+          for (size_t o : f.offsets)
+            column = restore(f, row + o, column);
+        }
+        return;
+      }
+      const size_t n = f.count * f.type_size;
+      for (size_t r = 0; r < num_rows; r++, row += row_size)
+      {
+        for (size_t o : f.offsets)
+        {
+          std::memcpy(column, row + o, n);
+          column += n;
+        }
+      }
+    }
+
+    // convert one instance of a field stored with less precision back to f.type. returns the end of what was written
+    static char* restore(const Field& f, const char* stored, char* out)
+    {
+      double values[64];
+      for (size_t i = 0; i < f.count; i += 64)
+      {
+        const size_t n = std::min<size_t>(f.count - i, 64);
+        load(f.storage, stored + i * f.stored_size(), n, f.scale, f.offset, values);
+        if (f.type_size == sizeof(double))
+          std::memcpy(out, values, n * sizeof(double));
+        else
+        {
+          for (size_t k = 0; k < n; k++)
+          {
+            const float v = (float)values[k];
+            std::memcpy(out + k * sizeof(float), &v, sizeof(float));
+          }
+        }
+        out += n * f.type_size;
+      }
+      return out;
+    }
+
+    std::string_view header_text;
+    Json header;
+    std::string compression;
+    size_t row_size = 0;
+    std::vector<Field> fields;
+    std::vector<std::string> codecs; // by block index (when blocked)
+    std::string_view body;           // everything after the header
+
+  private:
+    MappedFile file;
+    std::vector<char> owned;
+
+    void parse(const std::string_view bytes)
+    {
+      auto end = bytes.find('\0'); // the first zero is the end of the header string
+      if (end == std::string_view::npos)
+        throw std::runtime_error("no header found");
+      header_text = bytes.substr(0, end);
+      header = Json::parse(header_text);
+      body = bytes.substr(end + 1);
+      compression = header["compression"].string;
+      row_size = (size_t)header["row_size"].number;
+      if (auto c = header.find("codecs"))
+      {
+        for (auto& name : c->array)
+          codecs.push_back(name.string);
+      }
+      auto& entries = header["data_header"].array;
+      size_t total = layout(entries, 0, entries.size(), 0);
+      if (total != row_size || row_size == 0)
+        throw std::runtime_error("data_header describes " + std::to_string(total) + " bytes but row_size is " + std::to_string(row_size));
+    }
+
+    bool crc_matches(const Block& b) const
+    {
+      const char* h = body.data() + b.offset - block_format::framed_header_size + block_format::marker.size();
+      return crc32c(body.data() + b.offset, b.bytes, crc32c(h, block_format::header_size)) == b.crc;
+    }
+
+    std::vector<Block> framed_blocks(void) const
+    {
+      std::vector<Block> result;
+      size_t pos = 0;
+      size_t last = std::string_view::npos; // where the previous block starts
+      while (body.size() - pos >= block_format::framed_header_size)
+      {
+        if (body.compare(pos, block_format::marker.size(), block_format::marker) != 0)
+        {
+          // damaged. look again from just after the previous marker in case it was that blocks byte count that's wrong
+          // (anything that turns up inside the previous block won't verify)
+          const size_t found = body.find(block_format::marker, last == std::string_view::npos ? pos + 1 : last + 1);
+          if (found > pos && (result.empty() || result.back().intact))
+          {
+            // the previous block's header looked fine so what's between it and the next marker was skipped. blocks
+            // that lost their marker are found by following byte counts for as long as they fit
+            const size_t end = std::min(found, body.size());
+            size_t p = pos;
+            while (end - p >= block_format::framed_header_size)
+            {
+              uint32_t rows, bytes;
+              std::memcpy(&rows, body.data() + p + block_format::marker.size() + 1, sizeof(rows));
+              std::memcpy(&bytes, body.data() + p + block_format::marker.size() + 5, sizeof(bytes));
+              if (bytes > end - p - block_format::framed_header_size)
+                break;
+              result.push_back(Block{ p + block_format::framed_header_size, bytes, rows, (uint8_t)body[p + block_format::marker.size()], 0, false });
+              p += block_format::framed_header_size + bytes;
+            }
+            // whatever's left is one more lost block, unless it's too short to be one or it's the end of a previous
+            // block whose byte count was wrong (that block fails its crc and is already counted)
+            if (end - p >= block_format::framed_header_size && (result.empty() || result.back().offset > pos || crc_matches(result.back())))
+              result.push_back(Block{ p, end - p, 0, 0, 0, false });
+          }
+          if (found == std::string_view::npos)
+            break;
+          pos = found;
+          continue;
+        }
+        const char* h = body.data() + pos + block_format::marker.size();
+        uint32_t rows, bytes, crc;
+        std::memcpy(&rows, h + 1, sizeof(rows));
+        std::memcpy(&bytes, h + 5, sizeof(bytes));
+        std::memcpy(&crc, h + block_format::header_size, sizeof(crc));
+        const size_t offset = pos + block_format::framed_header_size;
+        const size_t available = body.size() - offset;
+        Block b{ offset, std::min<size_t>(bytes, available), rows, (uint8_t)h[0], crc, bytes <= available && (uint8_t)h[0] < codecs.size() };
+        result.push_back(b);
+        last = pos;
+        pos = b.intact ? offset + bytes : pos + 1; // a bad header can't be trusted for where the next block is
+      }
+      return result;
+    }
+
+    // walk the (flat) list of header entries the same way cap_load.m does. returns the number of bytes consumed
+    size_t layout(const std::vector<Json>& entries, size_t begin, size_t end, size_t base)
+    {
+      size_t offset = 0;
+      size_t i = begin;
+      while (i < end)
+      {
+        auto& e = entries[i];
+        auto& name = e["name"].string;
+        auto& type = e["type"].string;
+        size_t count = (size_t)e["count"].number;
+        if (type.empty())
+        {
+          // simple container
+          i++;
+          continue;
+        }
+        size_t type_size = BasicLog_detail::type_size(type);
+        if (type_size > 0)
+        {
+          // fundamental. struct arrays repeat these so look for an existing one first
+          auto f = std::find_if(fields.begin(), fields.end(), [&](const Field& F) { return F.name == name; });
+          if (f == fields.end())
+          {
+            Field field{ name, type, type_size, count, { base + offset } };
+            if (auto storage = e.find("storage"); storage && !storage->string.empty())
+            {
+              field.storage = storage_from_name(storage->string);
+              if (field.storage == Storage::none || (type != "float64" && type != "float32"))
+                throw std::runtime_error("can't read " + name + " (" + type + ") stored as \"" + storage->string + "\"");
+              field.scale = e["scale"].number;
+              field.offset = e["offset"].number;
+            }
+            fields.push_back(field);
+            f = fields.end() - 1;
+          }
+          else
+            f->offsets.push_back(base + offset);
+          offset += f->stored_size() * count;
+          i++;
+          continue;
+        }
+        // struct (array). its children immediately follow it
+        const std::string prefix = name + ".";
+        size_t j = i + 1;
+        while (j < end && entries[j]["name"].string.starts_with(prefix))
+          j++;
+        for (size_t k = 0; k < count; k++)
+          offset += layout(entries, i + 1, j, base + offset);
+        i = j;
+      }
+      return offset;
+    }
+  };
+
+  // the logs in a file written by Log::Container
+  class ContainerReader
+  {
+  public:
+    ContainerReader(const std::filesystem::path& path)
+      : file(path)
+    {
+      auto bytes = file.view();
+      size_t end = bytes.find('\0');
+      if (end == std::string_view::npos)
+        throw std::runtime_error(std::string("no container directory in ").append(path));
+      Json directory = Json::parse(bytes.substr(0, end));
+      for (auto& n : directory["logs"].array)
+        names.push_back(n.string);
+      // each logs header
+      size_t pos = end + 1;
+      for (size_t i = 0; i < names.size(); i++)
+      {
+        end = bytes.find('\0', pos);
+        if (end == std::string_view::npos)
+          throw std::runtime_error(std::string("missing log headers in ").append(path));
+        headers.push_back(bytes.substr(pos, end - pos));
+        pos = end + 1;
+      }
+      if (!read_index(pos))
+        scan(pos); // not closed properly
+    }
+
+    bool contains(const std::string_view name) const
+    {
+      return std::find(names.begin(), names.end(), name) != names.end();
+    }
+
+    // the header, a zero, and all of a logs bytes (i.e. what it would have written to a .cap file of its own)
+    std::vector<char> stream(const std::string_view name) const
+    {
+      const uint16_t tag = tag_of(name);
+      size_t size = headers[tag].size() + 1;
+      for (auto& b : index)
+        size += b.tag == tag ? b.size : 0;
+      std::vector<char> result;
+      result.reserve(size);
+      result.insert(result.end(), headers[tag].begin(), headers[tag].end());
+      result.push_back('\0');
+      for (auto& b : index)
+      {
+        if (b.tag == tag)
+          result.insert(result.end(), file.data() + b.offset, file.data() + b.offset + b.size);
+      }
+      return result;
+    }
+
+    // just the header and a zero (enough for a Reader's fields without any rows)
+    std::vector<char> header(const std::string_view name) const
+    {
+      const uint16_t tag = tag_of(name);
+      std::vector<char> result(headers[tag].begin(), headers[tag].end());
+      result.push_back('\0');
+      return result;
+    }
+
+    // Reader::decode_batches for one of the logs, decoded from the container's blocks (through the index) instead of a
+    // copy of its whole stream. blocked logs go a window of whole blocks at a time, the rest straight from the blocks
+    template <typename Use>
+    size_t decode_batches(const std::string_view name, size_t batch_rows, Use&& use, size_t* damaged_blocks = nullptr) const
+    {
+      const uint16_t tag = tag_of(name);
+      std::vector<char> window = header(name);
+      const size_t header_size = window.size();
+      const Reader log(window.data(), header_size);
+      if (damaged_blocks)
+        *damaged_blocks = 0;
+      if (!log.is_blocked())
+        return decode_stream(tag, log, batch_rows, use);
+
+      size_t total = 0;
+      size_t window_bytes = std::max<size_t>(batch_rows * log.row_size, 4 << 20);
+      size_t released = 0; // pages of the file already read
+      auto next = index.begin();
+      while (true)
+      {
+        for (; next != index.end() && (next->tag != tag || window.size() - header_size < window_bytes); ++next)
+        {
+          if (next->tag == tag)
+            window.insert(window.end(), file.data() + next->offset, file.data() + next->offset + next->size);
+        }
+        while (next != index.end() && next->tag != tag)
+          ++next;
+        const bool last = next == index.end();
+        released = file.release(released, last ? file.size() : next->offset);
+        // everything before the last block is decoded now, that block (which may not all be here) starts the next window
+        size_t end = window.size() - header_size;
+        if (!last)
+        {
+          const Reader R(window.data(), window.size());
+          end = last_block(R);
+          if (end == 0)
+          {
+            window_bytes *= 2; // a block bigger than the window
+            continue;
+          }
+        }
+        const Reader R(window.data(), header_size + end);
+        size_t damaged = 0;
+        total += R.decode_batches(batch_rows, use, &damaged);
+        if (damaged_blocks)
+          *damaged_blocks += damaged;
+        if (last)
+          return total;
+        window.erase(window.begin() + header_size, window.begin() + header_size + end);
+      }
+    }
+
+    std::vector<std::string> names; // by tag
+
+  private:
+    struct BlockRef
+    {
+      uint16_t tag;
+      size_t offset;
+      size_t size;
+    };
+
+    static constexpr std::string_view index_magic = "CAPCIDX1";
+    static constexpr size_t block_header_size = 2 + 4;
+    static constexpr size_t index_entry_size = 2 + 8 + 4;
+
+    MappedFile file;
+    std::vector<std::string_view> headers; // by tag
+    std::vector<BlockRef> index;
+
+    uint16_t tag_of(const std::string_view name) const
+    {
+      auto n = std::find(names.begin(), names.end(), name);
+      if (n == names.end())
+        throw std::runtime_error(std::string("container has no log named \"").append(name).append("\""));
+      return n - names.begin();
+    }
+
+    // where the last block that starts with a header (and, if framed, a marker) begins in R.body. 0 if there's only one
+    static size_t last_block(const Reader& R)
+    {
+      const size_t header_size = R.is_framed() ? block_format::framed_header_size : block_format::header_size;
+      auto list = R.blocks();
+      for (auto b = list.rbegin(); b != list.rend(); ++b)
+      {
+        if (b->offset >= header_size && (!R.is_framed() || R.body.compare(b->offset - header_size, block_format::marker.size(), block_format::marker) == 0))
+          return b->offset - header_size;
+      }
+      return 0;
+    }
+
+    // a log that isn't blocked is one run of rows through one codec. a row split between container blocks is put back
+    // together in 'carry' (a bit more of the next block at a time until it decodes), everything else is decoded in place
+    template <typename Use>
+    size_t decode_stream(uint16_t tag, const Reader& log, size_t batch_rows, Use& use) const
+    {
+      const size_t batch_bytes = std::max<size_t>(batch_rows, 1) * log.row_size;
+      auto codec = CodecRegistry::make(log.compression);
+      codec->reset(log.row_size);
+      std::vector<char> storage, carry;
+      storage.reserve(batch_bytes);
+      size_t total = 0;
+      size_t released = 0; // pages of the file already read
+      auto flush = [&]() {
+        const size_t n = log.rows(std::string_view(storage.data(), storage.size()));
+        if (n == 0)
+          return;
+        use(std::string_view(storage.data(), n * log.row_size));
+        total += n;
+        storage.clear();
+      };
+      // returns the bytes used
+      auto decode = [&](const char* in, size_t size) {
+        size_t pos = 0;
+        for (size_t n; pos < size && (n = codec->decode(in + pos, size - pos, storage)) > 0; pos += n)
+        {
+          if (storage.size() >= batch_bytes)
+            flush();
+        }
+        return pos;
+      };
+      for (auto& b : index)
+      {
+        if (b.tag != tag)
+          continue;
+        const char* in = file.data() + b.offset;
+        size_t pos = 0;
+        while (!carry.empty() && pos < b.size)
+        {
+          const size_t before = carry.size();
+          const size_t add = std::min(b.size - pos, std::max<size_t>(before, 64));
+          carry.insert(carry.end(), in + pos, in + pos + add);
+          const size_t used = decode(carry.data(), carry.size());
+          if (used >= before)
+          {
+            pos += used - before;
+            carry.clear();
+          }
+          else
+          {
+            carry.erase(carry.begin(), carry.begin() + used);
+            pos += add;
+          }
+        }
+        if (carry.empty())
+        {
+          pos += decode(in + pos, b.size - pos);
+          carry.assign(in + pos, in + b.size);
+        }
+        released = file.release(released, b.offset + b.size);
+      }
+      flush();
+      return total;
+    }
+
+    template <typename T>
+    T read(size_t pos) const
+    {
+      T value;
+      std::memcpy(&value, file.data() + pos, sizeof(T));
+      return value;
+    }
+
+    // use the index written when the container was closed
+    bool read_index(size_t data_begin)
+    {
+      const size_t trailer_size = 8 + 4 + index_magic.size();
+      const size_t size = file.size();
+      if (size < data_begin + trailer_size || file.view().substr(size - index_magic.size()) != index_magic)
+        return false;
+      const size_t index_offset = read<uint64_t>(size - trailer_size);
+      const size_t count = read<uint32_t>(size - trailer_size + 8);
+      if (index_offset < data_begin || index_offset + count * index_entry_size != size - trailer_size)
+        return false;
+      for (size_t i = 0; i < count; i++)
+      {
+        const size_t pos = index_offset + i * index_entry_size;
+        BlockRef b{ read<uint16_t>(pos), read<uint64_t>(pos + 2), read<uint32_t>(pos + 10) };
+        if (b.tag >= names.size() || b.offset + b.size > index_offset)
+          return false;
+        index.push_back(b);
+      }
+      return true;
+    }
+
+    // walk the blocks one at a time
+    void scan(size_t pos)
+    {
+      index.clear();
+      const size_t size = file.size();
+      while (size - pos >= block_header_size)
+      {
+        BlockRef b{ read<uint16_t>(pos), pos + block_header_size, read<uint32_t>(pos + 2) };
+        if (b.tag >= names.size())
+          break; // garbage
+        b.size = std::min(b.size, size - b.offset);
+        index.push_back(b);
+        pos = b.offset + b.size;
+      }
+    }
+  };
+}
@@ -0,0 +1,357 @@
+// capconv: concatenate every segment of a log written by a Log::Manager and write one flat, mmap-able .bin per field
+// plus a json index describing them.
+//
+// usage: capconv <root_directory> <log_name> <output_directory> [threads]
+//
+// <root_directory> is what was given to the Log::Manager (it contains one directory per unix_time_formatted() segment)
+// segments are decoded in parallel and written in time order. they're decoded a batch of rows at a time and at most
+// memory_budget bytes of decoded rows wait to be written, however long the segments are. containers (.capc) are decoded
+// through their index rather than from a copy of the log's stream.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <future>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include <optional>
+#include <ctime>
+
+#include "cap_reader.hpp"
+
+using namespace BasicLog;
+
+namespace
+{
+  constexpr size_t batch_bytes = 1 << 20;     // of decoded rows per batch
+  constexpr size_t memory_budget = 256 << 20; // decoded bytes waiting to be written (across all segments)
+
+  struct Segment
+  {
+    std::filesystem::path path; // the logs own .cap file or a container (.capc) holding it
+    std::time_t time;           // utc
+  };
+
+  // some rows of a segment, a column per field
+  struct Batch
+  {
+    size_t rows = 0;
+    size_t bytes = 0;
+    std::vector<std::vector<char>> columns;
+  };
+
+  // hands batches from the decoding threads to the writer, which takes them one segment at a time in order. decoders
+  // wait while the budget is used up, except for the segment being written (everything else waits on that one)
+  class Pipeline
+  {
+    struct Decoded
+    {
+      std::deque<Batch> batches;
+      bool done = false;
+      size_t damaged_blocks = 0; // framed blocks that failed verification (left out)
+      std::exception_ptr error;
+    };
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<Decoded> segments;
+    size_t front = 0;  // the segment being written
+    size_t queued = 0; // bytes
+    bool aborted = false;
+
+  public:
+    Pipeline(size_t num_segments)
+      : segments(num_segments)
+    { }
+
+    // false once the writer has given up
+    bool put(size_t s, Batch b)
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [&] { return aborted || s == front || queued + b.bytes <= memory_budget; });
+      if (aborted)
+        return false;
+      queued += b.bytes;
+      segments[s].batches.push_back(std::move(b));
+      changed.notify_all();
+      return true;
+    }
+
+    void finish(size_t s, size_t damaged_blocks, std::exception_ptr error)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      segments[s].done = true;
+      segments[s].damaged_blocks = damaged_blocks;
+      segments[s].error = error;
+      changed.notify_all();
+    }
+
+    // the next batch of the front segment. false once it's all been taken (rethrows whatever stopped its decoding)
+    bool get(Batch& b)
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      auto& d = segments[front];
+      changed.wait(guard, [&] { return !d.batches.empty() || d.done; });
+      if (d.batches.empty())
+      {
+        if (d.error)
+          std::rethrow_exception(d.error);
+        return false;
+      }
+      b = std::move(d.batches.front());
+      d.batches.pop_front();
+      queued -= b.bytes;
+      changed.notify_all();
+      return true;
+    }
+
+    // done with the front segment. returns its damaged block count
+    size_t next(void)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      changed.notify_all();
+      return segments[front++].damaged_blocks;
+    }
+
+    void abort(void)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      aborted = true;
+      changed.notify_all();
+    }
+  };
+
+  // segment directories are named by Log::unix_time_formatted() ("%Y%m%d_%H%M%S%z")
+  bool parse_segment_time(const std::string& name, std::time_t& t)
+  {
+    std::tm tm{};
+    std::istringstream ss(name);
+    ss >> std::get_time(&tm, "%Y%m%d_%H%M%S");
+    if (ss.fail())
+      return false;
+    long offset = 0;
+    char sign;
+    int hhmm;
+    if (ss >> sign >> hhmm && (sign == '+' || sign == '-'))
+      offset = (hhmm / 100 * 3600 + hhmm % 100 * 60) * (sign == '-' ? -1 : 1);
+    t = timegm(&tm) - offset;
+    return true;
+  }
+
+  std::vector<Segment> find_segments(const std::filesystem::path& root, const std::string& log_name)
+  {
+    std::vector<Segment> segments;
+    for (auto& d : std::filesystem::directory_iterator(root))
+    {
+      if (!d.is_directory())
+        continue;
+      std::time_t t = 0;
+      if (!parse_segment_time(d.path().filename(), t))
+        continue;
+      auto file = d.path() / (log_name + ".cap");
+      if (std::filesystem::is_regular_file(file))
+      {
+        segments.push_back(Segment{ file, t });
+        continue;
+      }
+      for (auto& f : std::filesystem::directory_iterator(d.path()))
+      {
+        if (f.path().extension() == ".capc" && ContainerReader(f.path()).contains(log_name))
+        {
+          segments.push_back(Segment{ f.path(), t });
+          break;
+        }
+      }
+    }
+    std::sort(segments.begin(), segments.end(), [](const Segment& A, const Segment& B) {
+      return A.time != B.time ? A.time < B.time : A.path < B.path; });
+    return segments;
+  }
+
+  // for a container, just the header (its rows are decoded through the container by decode_segment)
+  std::unique_ptr<Reader> open_segment(const Segment& segment, const std::string& log_name)
+  {
+    if (segment.path.extension() == ".capc")
+      return std::make_unique<Reader>(ContainerReader(segment.path).header(log_name));
+    return std::make_unique<Reader>(segment.path);
+  }
+
+  // returns the number of damaged blocks
+  size_t decode_segment(const Segment& segment, size_t s, const std::string& log_name, const Reader& reference, Pipeline& pipeline)
+  {
+    std::optional<ContainerReader> container;
+    std::unique_ptr<Reader> R;
+    if (segment.path.extension() == ".capc")
+    {
+      container.emplace(segment.path);
+      R = std::make_unique<Reader>(container->header(log_name));
+    }
+    else
+      R = std::make_unique<Reader>(segment.path);
+    auto& reader = *R;
+    if (reader.row_size != reference.row_size || reader.fields != reference.fields)
+      throw std::runtime_error(std::string("header does not match the first segment: ").append(segment.path));
+
+    size_t damaged_blocks = 0;
+    auto put = [&](std::string_view rows) {
+      Batch b;
+      b.rows = reader.rows(rows);
+      b.columns.resize(reader.fields.size());
+      for (size_t i = 0; i < reader.fields.size(); i++)
+      {
+        auto& f = reader.fields[i];
+        b.columns[i].resize(b.rows * f.elements() * f.type_size);
+        reader.extract(f, rows, b.columns[i].data());
+        b.bytes += b.columns[i].size();
+      }
+      if (!pipeline.put(s, std::move(b)))
+        throw std::runtime_error("stopped");
+    };
+    const size_t batch_rows = std::max<size_t>(batch_bytes / reader.row_size, 1);
+    if (container)
+      container->decode_batches(log_name, batch_rows, put, &damaged_blocks);
+    else
+      reader.decode_batches(batch_rows, put, &damaged_blocks);
+    return damaged_blocks;
+  }
+
+  std::string quoted(const std::string& s)
+  {
+    std::string q("\"");
+    for (char c : s)
+    {
+      if (c == '"' || c == '\\')
+        q.push_back('\\');
+      q.push_back(c);
+    }
+    return q.append("\"");
+  }
+
+  void convert(const std::filesystem::path& root, const std::string& log_name, const std::filesystem::path& out_dir, size_t threads)
+  {
+    auto segments = find_segments(root, log_name);
+    if (segments.empty())
+      throw std::runtime_error("no segments of \"" + log_name + "\" found in " + root.string());
+
+    std::filesystem::create_directories(out_dir);
+    auto first = open_segment(segments[0], log_name);
+    const Reader& reference = *first;
+
+    std::vector<std::ofstream> out(reference.fields.size());
+    for (size_t i = 0; i < out.size(); i++)
+    {
+      auto file_path = out_dir / (reference.fields[i].name + ".bin");
+      out[i].open(file_path, std::ios_base::binary | std::ios_base::trunc);
+      if (!out[i])
+        throw std::runtime_error(std::string("failed to create ").append(file_path));
+    }
+
+    // 'threads' decoders take the segments in order while the oldest one is written out
+    Pipeline pipeline(segments.size());
+    std::atomic<size_t> next = 0;
+    auto decode = [&]() {
+      for (size_t s; (s = next++) < segments.size();)
+      {
+        size_t damaged_blocks = 0;
+        std::exception_ptr error;
+        try
+        {
+          damaged_blocks = decode_segment(segments[s], s, log_name, reference, pipeline);
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+        }
+        pipeline.finish(s, damaged_blocks, error);
+      }
+    };
+    std::vector<std::future<void>> decoders;
+    for (size_t t = 0; t < std::min(threads, segments.size()); t++)
+      decoders.push_back(std::async(std::launch::async, decode));
+
+    std::vector<size_t> first_row;
+    std::vector<size_t> segment_rows;
+    size_t total_rows = 0;
+    try
+    {
+      for (size_t s = 0; s < segments.size(); s++)
+      {
+        size_t rows = 0;
+        for (Batch b; pipeline.get(b);)
+        {
+          for (size_t i = 0; i < out.size(); i++)
+            out[i].write(b.columns[i].data(), b.columns[i].size());
+          rows += b.rows;
+        }
+        const size_t damaged_blocks = pipeline.next();
+        first_row.push_back(total_rows);
+        segment_rows.push_back(rows);
+        total_rows += rows;
+        std::cerr << segments[s].path.string() << ": " << rows << " rows";
+        if (damaged_blocks)
+          std::cerr << " (skipped " << damaged_blocks << " damaged blocks)";
+        std::cerr << '\n';
+      }
+    }
+    catch (...)
+    {
+      pipeline.abort(); // so the decoders don't wait for room that's never coming
+      for (auto& d : decoders)
+        d.wait();
+      throw;
+    }
+    for (auto& d : decoders)
+      d.get();
+    for (auto& o : out)
+    {
+      o.flush();
+      if (!o)
+        throw std::runtime_error("failed writing output");
+    }
+
+    // the index
+    std::ofstream index(out_dir / (log_name + ".json"), std::ios_base::trunc);
+    index << "{\n\"log\":" << quoted(log_name) << ",\n\"rows\":" << total_rows << ",\n\"fields\":[\n";
+    for (size_t i = 0; i < reference.fields.size(); i++)
+    {
+      auto& f = reference.fields[i];
+      index << (i ? ",\n" : "") << "{\"name\":" << quoted(f.name) << ",\"type\":" << quoted(f.type) << ",\"count\":" << f.elements()
+            << ",\"instances\":" << f.offsets.size() << ",\"file\":" << quoted(f.name + ".bin") << "}";
+    }
+    index << "\n],\n\"segments\":[\n";
+    for (size_t s = 0; s < segments.size(); s++)
+    {
+      index << (s ? ",\n" : "") << "{\"file\":" << quoted(segments[s].path.string()) << ",\"time\":" << segments[s].time
+            << ",\"first_row\":" << first_row[s] << ",\"rows\":" << segment_rows[s] << "}";
+    }
+    index << "\n]\n}\n";
+    if (!index)
+      throw std::runtime_error("failed writing index");
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc < 4 || argc > 5)
+  {
+    std::cerr << "usage: " << argv[0] << " <root_directory> <log_name> <output_directory> [threads]\n";
+    return 2;
+  }
+  size_t threads = argc == 5 ? std::stoul(argv[4]) : std::thread::hardware_concurrency();
+  if (threads == 0)
+    threads = 1;
+  try
+  {
+    convert(argv[1], argv[2], argv[3], threads);
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "capconv: " << e.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,591 @@
+#pragma once
+#include <string_view>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+namespace BasicLog
+{
+  // turns rows into bytes and back. each stream (or block) gets its own instance so codecs are free to keep state between rows
+  class Codec
+  {
+  public:
+    virtual ~Codec() = default;
+
+    // called before the first row of a stream or block
+    virtual void reset(size_t row_size) = 0;
+
+    // append the encoded row to 'out'
+    virtual void encode(const char* row, std::vector<char>& out) = 0;
+
+    // append anything the codec is still holding on to (end of a stream or block)
+    virtual void finish(std::vector<char>&) { }
+
+    // decode the next row(s) in 'in' and append them to 'rows'. returns the number of bytes used, 0 if 'in' doesn't hold a complete row
+    virtual size_t decode(const char* in, size_t size, std::vector<char>& rows) = 0;
+
+    // like decode but only counts the row(s) in 'rows'. returns the number of bytes used, 0 if 'in' doesn't hold a complete
+    // row. codecs that can find the end of a row without decoding it override this (and can't decode after skipping)
+    virtual size_t skip(const char* in, size_t size, size_t row_size, size_t& rows)
+    {
+      skipped.clear();
+      const size_t used = decode(in, size, skipped);
+      rows += skipped.size() / row_size;
+      return used;
+    }
+
+  private:
+    std::vector<char> skipped;
+  };
+
+  using CodecFactory = std::function<std::unique_ptr<Codec>()>;
+
+  // every row as is
+  class RAWCodec : public Codec
+  {
+    size_t row_size = 0;
+
+  public:
+    void reset(size_t Row_size) override
+    {
+      row_size = Row_size;
+    }
+
+    void encode(const char* row, std::vector<char>& out) override
+    {
+      out.insert(out.end(), row, row + row_size);
+    }
+
+    size_t decode(const char* in, size_t size, std::vector<char>& rows) override
+    {
+      if (size < row_size)
+        return 0;
+      rows.insert(rows.end(), in, in + row_size);
+      return row_size;
+    }
+
+    size_t skip(const char*, size_t size, size_t, size_t& rows) override
+    {
+      if (size < row_size)
+        return 0;
+      rows++;
+      return row_size;
+    }
+  };
+
+  // a bit per byte of the row (set if the byte changed) followed by the change of each byte that changed
+  class DIFF1Codec : public Codec
+  {
+    std::vector<char> previous_row; // padded to a multiple of 8 bytes
+    std::vector<char> prefix;
+    size_t row_size = 0;
+
+    // for each possible prefix byte: where each of the (packed) changes goes within the 8 bytes it covers (0x80 = nowhere)
+    struct ExpandTable
+    {
+      alignas(8) uint8_t mask[256][8];
+
+      constexpr ExpandTable()
+        : mask()
+      {
+        for (int b = 0; b < 256; b++)
+        {
+          uint8_t k = 0;
+          for (int i = 0; i < 8; i++)
+            mask[b][i] = (b >> i) & 1 ? k++ : 0x80;
+        }
+      }
+    };
+
+  public:
+    void reset(size_t Row_size) override
+    {
+      row_size = Row_size;
+      const size_t num_bits = row_size / 8 + (row_size % 8 > 0); // number of bytes we need to get at least one bit per byte
+      previous_row.assign(num_bits * 8, 0);
+      prefix.assign(num_bits, 0);
+    }
+
+    void encode(const char* row, std::vector<char>& out) override
+    {
+      std::fill(prefix.begin(), prefix.end(), 0);
+      const size_t prefix_pos = out.size();
+      out.resize(prefix_pos + prefix.size()); // filled in once we know it
+      for (size_t i = 0; i < row_size; i++)
+      {
+        const char delta = row[i] - previous_row[i];
+        if (delta == 0)
+          continue;
+        prefix[i / 8] |= 1U << (i % 8); // set the bit
+        out.push_back(delta);
+      }
+      std::memcpy(out.data() + prefix_pos, prefix.data(), prefix.size());
+      std::memcpy(previous_row.data(), row, row_size);
+    }
+
+    size_t decode(const char* in, size_t size, std::vector<char>& rows) override
+    {
+      const size_t num_bits = prefix.size();
+      if (size < num_bits)
+        return 0;
+      const unsigned char* bits = (const unsigned char*)in;
+      size_t count = 0;
+      for (size_t b = 0; b < num_bits; b++)
+        count += __builtin_popcount(bits[b]);
+      if (size - num_bits < count)
+        return 0; // incomplete row
+      const char* delta = in + num_bits;
+      [[maybe_unused]] const char* in_end = in + size;
+      char* prev = previous_row.data();
+      for (size_t b = 0; b < num_bits; b++)
+      {
+        unsigned byte = bits[b];
+        if (byte == 0)
+          continue;
+#if defined(__SSSE3__)
+        static constexpr ExpandTable expand_table{};
+        // spread the packed changes out to where they belong and add all 8 bytes at once
+        if (in_end - delta >= 8)
+        {
+          __m128i d = _mm_loadl_epi64((const __m128i*)delta);
+          __m128i m = _mm_loadl_epi64((const __m128i*)expand_table.mask[byte]);
+          __m128i p = _mm_loadl_epi64((const __m128i*)(prev + b * 8));
+          _mm_storel_epi64((__m128i*)(prev + b * 8), _mm_add_epi8(p, _mm_shuffle_epi8(d, m)));
+          delta += __builtin_popcount(byte);
+          continue;
+        }
+#endif
+        while (byte)
+        {
+          prev[b * 8 + __builtin_ctz(byte)] += *delta++;
+          byte &= byte - 1;
+        }
+      }
+      rows.insert(rows.end(), previous_row.begin(), previous_row.begin() + row_size);
+      return num_bits + count;
+    }
+
+    // the prefix says how many changes follow
+    size_t skip(const char* in, size_t size, size_t, size_t& rows) override
+    {
+      const size_t num_bits = prefix.size();
+      if (size < num_bits)
+        return 0;
+      size_t count = 0, b = 0;
+      for (uint64_t word; b + 8 <= num_bits; b += 8)
+      {
+        std::memcpy(&word, in + b, sizeof(word));
+        count += __builtin_popcountll(word);
+      }
+      for (; b < num_bits; b++)
+        count += __builtin_popcount((unsigned char)in[b]);
+      if (size - num_bits < count)
+        return 0;
+      rows++;
+      return num_bits + count;
+    }
+  };
+
+  // like DIFF1 but cheaper when little changes. each row that changed is one of these tokens:
+  //   BITMAP: a bit per 64 byte region (set if anything in it changed), a bit per byte of each region that changed, then the changes
+  //   POSITIONS: number of changed bytes (varint), then for each: bytes skipped since the last one (varint) and the change
+  // rows that didn't change at all are counted and written as a REPEAT token: the number of rows (varint, at most max_repeats)
+  class DIFF2Codec : public Codec
+  {
+  public:
+    enum Token : char
+    {
+      REPEAT,
+      BITMAP,
+      POSITIONS
+    };
+    static constexpr size_t region_size = 64;
+    static constexpr size_t max_repeats = 4096;
+
+  private:
+    std::vector<char> previous_row;
+    std::vector<char> level1;       // a bit per region
+    std::vector<uint32_t> changed;  // positions of the bytes that changed
+    std::vector<char> delta;        // and by how much
+    size_t repeats = 0;             // rows since the last change
+    size_t row_size = 0;
+    size_t num_regions = 0;
+
+    static void put_varint(std::vector<char>& out, size_t value)
+    {
+      while (value >= 0x80)
+      {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+      }
+      out.push_back((char)value);
+    }
+
+    static size_t varint_size(size_t value)
+    {
+      size_t n = 1;
+      while (value >= 0x80)
+      {
+        value >>= 7;
+        n++;
+      }
+      return n;
+    }
+
+    // returns bytes used, 0 if incomplete
+    static size_t get_varint(const char* in, size_t size, size_t& value)
+    {
+      value = 0;
+      for (size_t i = 0; i < size && i < 10; i++)
+      {
+        value |= (size_t)(in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0)
+          return i + 1;
+      }
+      return 0;
+    }
+
+    size_t region_bytes(size_t region) const
+    {
+      const size_t n = std::min(region_size, row_size - region * region_size);
+      return n / 8 + (n % 8 > 0);
+    }
+
+    void flush_repeats(std::vector<char>& out)
+    {
+      if (repeats == 0)
+        return;
+      out.push_back(REPEAT);
+      put_varint(out, repeats);
+      repeats = 0;
+    }
+
+  public:
+    void reset(size_t Row_size) override
+    {
+      row_size = Row_size;
+      num_regions = row_size / region_size + (row_size % region_size > 0);
+      previous_row.assign(row_size, 0);
+      level1.assign(num_regions / 8 + (num_regions % 8 > 0), 0);
+      changed.resize(row_size);
+      delta.resize(row_size);
+      repeats = 0;
+    }
+
+    void encode(const char* row, std::vector<char>& out) override
+    {
+      // find what changed, skipping over whole regions that didn't
+      std::fill(level1.begin(), level1.end(), 0);
+      size_t count = 0;
+      size_t positions_size = 0; // what a POSITIONS token would cost (less the count)
+      size_t bitmap_size = 0;    // level 2 bitmap bytes
+      size_t last = (size_t)-1;
+      for (size_t r = 0; r < num_regions; r++)
+      {
+        const size_t begin = r * region_size;
+        const size_t end = std::min(begin + region_size, row_size);
+        if (std::memcmp(row + begin, previous_row.data() + begin, end - begin) == 0)
+          continue;
+        level1[r / 8] |= 1U << (r % 8);
+        bitmap_size += region_bytes(r);
+        for (size_t i = begin; i < end; i++)
+        {
+          const char d = row[i] - previous_row[i];
+          if (d == 0)
+            continue;
+          positions_size += varint_size(i - last - 1) + 1;
+          last = i;
+          changed[count] = i;
+          delta[count] = d;
+          count++;
+        }
+        std::memcpy(previous_row.data() + begin, row + begin, end - begin);
+      }
+
+      if (count == 0)
+      {
+        if (++repeats == max_repeats)
+          flush_repeats(out);
+        return;
+      }
+      flush_repeats(out);
+
+      if (varint_size(count) + positions_size < level1.size() + bitmap_size + count)
+      {
+        out.push_back(POSITIONS);
+        put_varint(out, count);
+        last = (size_t)-1;
+        for (size_t k = 0; k < count; k++)
+        {
+          put_varint(out, changed[k] - last - 1);
+          out.push_back(delta[k]);
+          last = changed[k];
+        }
+        return;
+      }
+
+      out.push_back(BITMAP);
+      out.insert(out.end(), level1.begin(), level1.end());
+      size_t pos = out.size();
+      out.resize(pos + bitmap_size, 0);
+      size_t k = 0;
+      for (size_t r = 0; r < num_regions && k < count; r++)
+      {
+        if (!(level1[r / 8] & (1U << (r % 8))))
+          continue;
+        char* bits = out.data() + pos;
+        const size_t begin = r * region_size;
+        const size_t end = std::min(begin + region_size, row_size);
+        for (; k < count && changed[k] < end; k++)
+        {
+          const size_t b = changed[k] - begin;
+          bits[b / 8] |= 1U << (b % 8);
+        }
+        pos += region_bytes(r);
+      }
+      out.insert(out.end(), delta.begin(), delta.begin() + count);
+    }
+
+    void finish(std::vector<char>& out) override
+    {
+      flush_repeats(out);
+    }
+
+    size_t decode(const char* in, size_t size, std::vector<char>& rows) override
+    {
+      if (size == 0)
+        return 0;
+      size_t pos = 1;
+      switch (in[0])
+      {
+      case REPEAT:
+      {
+        size_t n, used = get_varint(in + pos, size - pos, n);
+        if (used == 0)
+          return 0;
+        if (n > max_repeats)
+          throw std::runtime_error("DIFF2: too many repeated rows");
+        for (size_t i = 0; i < n; i++)
+          rows.insert(rows.end(), previous_row.begin(), previous_row.end());
+        return pos + used;
+      }
+      case BITMAP:
+      {
+        if (size - pos < level1.size())
+          return 0;
+        const unsigned char* l1 = (const unsigned char*)in + pos;
+        pos += level1.size();
+        // where do the changes start
+        size_t deltas = pos;
+        size_t count = 0;
+        for (size_t r = 0; r < num_regions; r++)
+        {
+          if (!(l1[r / 8] & (1U << (r % 8))))
+            continue;
+          const size_t n = region_bytes(r);
+          if (size - deltas < n)
+            return 0;
+          for (size_t b = 0; b < n; b++)
+            count += __builtin_popcount((unsigned char)in[deltas + b]);
+          // the last region may be partial
+          const size_t valid = row_size - r * region_size - (n - 1) * 8;
+          if (valid < 8 && ((unsigned char)in[deltas + n - 1] >> valid) != 0)
+            throw std::runtime_error("DIFF2: change beyond the end of the row");
+          deltas += n;
+        }
+        if (size - deltas < count)
+          return 0;
+        const size_t used = deltas + count;
+        // apply them
+        for (size_t r = 0; r < num_regions; r++)
+        {
+          if (!(l1[r / 8] & (1U << (r % 8))))
+            continue;
+          const size_t n = region_bytes(r);
+          for (size_t b = 0; b < n; b++)
+          {
+            unsigned bits = (unsigned char)in[pos + b];
+            while (bits)
+            {
+              previous_row[r * region_size + b * 8 + __builtin_ctz(bits)] += in[deltas++];
+              bits &= bits - 1;
+            }
+          }
+          pos += n;
+        }
+        rows.insert(rows.end(), previous_row.begin(), previous_row.end());
+        return used;
+      }
+      case POSITIONS:
+      {
+        size_t count, used = get_varint(in + pos, size - pos, count);
+        if (used == 0)
+          return 0;
+        pos += used;
+        // check it's all here before touching previous_row
+        size_t check = pos;
+        for (size_t k = 0; k < count; k++)
+        {
+          size_t gap;
+          used = get_varint(in + check, size - check, gap);
+          if (used == 0 || size - check - used < 1)
+            return 0;
+          check += used + 1;
+        }
+        size_t i = (size_t)-1;
+        for (size_t k = 0; k < count; k++)
+        {
+          size_t gap;
+          pos += get_varint(in + pos, size - pos, gap);
+          i += gap + 1;
+          if (i >= row_size)
+            throw std::runtime_error("DIFF2: position beyond the end of the row");
+          previous_row[i] += in[pos++];
+        }
+        rows.insert(rows.end(), previous_row.begin(), previous_row.end());
+        return pos;
+      }
+      default:
+        throw std::runtime_error("DIFF2: unexpected token");
+      }
+    }
+
+    // steps over the tokens (a REPEAT is all its rows at once)
+    size_t skip(const char* in, size_t size, size_t, size_t& rows) override
+    {
+      if (size == 0)
+        return 0;
+      size_t pos = 1;
+      switch (in[0])
+      {
+      case REPEAT:
+      {
+        size_t n, used = get_varint(in + pos, size - pos, n);
+        if (used == 0)
+          return 0;
+        if (n > max_repeats)
+          throw std::runtime_error("DIFF2: too many repeated rows");
+        rows += n;
+        return pos + used;
+      }
+      case BITMAP:
+      {
+        if (size - pos < level1.size())
+          return 0;
+        const unsigned char* l1 = (const unsigned char*)in + pos;
+        pos += level1.size();
+        size_t count = 0;
+        for (size_t r = 0; r < num_regions; r++)
+        {
+          if (!(l1[r / 8] & (1U << (r % 8))))
+            continue;
+          const size_t n = region_bytes(r);
+          if (size - pos < n)
+            return 0;
+          for (size_t b = 0; b < n; b++)
+            count += __builtin_popcount((unsigned char)in[pos + b]);
+          pos += n;
+        }
+        if (size - pos < count)
+          return 0;
+        rows++;
+        return pos + count;
+      }
+      case POSITIONS:
+      {
+        size_t count, used = get_varint(in + pos, size - pos, count);
+        if (used == 0)
+          return 0;
+        pos += used;
+        for (size_t k = 0; k < count; k++)
+        {
+          size_t gap;
+          used = get_varint(in + pos, size - pos, gap);
+          if (used == 0 || size - pos - used < 1)
+            return 0;
+          pos += used + 1;
+        }
+        rows++;
+        return pos;
+      }
+      default:
+        throw std::runtime_error("DIFF2: unexpected token");
+      }
+    }
+  };
+
+  // codecs by name (the name is what ends up in the header)
+  class CodecRegistry
+  {
+    static std::mutex& lock(void)
+    {
+      static std::mutex m;
+      return m;
+    }
+
+    static std::map<std::string, CodecFactory, std::less<>>& codecs(void)
+    {
+      static std::map<std::string, CodecFactory, std::less<>> c = {
+        { "RAW", []() { return std::make_unique<RAWCodec>(); } },
+        { "DIFF1", []() { return std::make_unique<DIFF1Codec>(); } },
+        { "DIFF2", []() { return std::make_unique<DIFF2Codec>(); } },
+      };
+      return c;
+    }
+
+  public:
+    // add (or replace) a codec
+    static void add(const std::string_view name, CodecFactory factory)
+    {
+      if (name.empty() || name == "ADAPTIVE")
+        throw std::runtime_error(std::string("invalid codec name \"").append(name).append("\""));
+      std::lock_guard<std::mutex> guard(lock());
+      codecs()[std::string(name)] = factory;
+    }
+
+    static bool contains(const std::string_view name)
+    {
+      std::lock_guard<std::mutex> guard(lock());
+      return codecs().find(name) != codecs().end();
+    }
+
+    static std::unique_ptr<Codec> make(const std::string_view name)
+    {
+      std::lock_guard<std::mutex> guard(lock());
+      auto c = codecs().find(name);
+      if (c == codecs().end())
+        throw std::runtime_error(std::string("unknown codec \"").append(name).append("\""));
+      return c->second();
+    }
+
+    static std::vector<std::string> names(void)
+    {
+      std::lock_guard<std::mutex> guard(lock());
+      std::vector<std::string> n;
+      for (auto& c : codecs())
+        n.push_back(c.first);
+      return n;
+    }
+  };
+
+  // streams with "block_rows" in their header are a sequence of blocks: codec index (uint8), row count (uint32),
+  // byte count (uint32), encoded rows. framed blocks (see Log::set_framing) start with a marker and have a CRC32C
+  // (of the codec index, counts and encoded rows) just before the encoded rows
+  namespace block_format
+  {
+    inline constexpr std::string_view marker{ "\x89" "CAPBLK\x1a", 8 };
+    inline constexpr size_t header_size = 1 + 4 + 4;
+    inline constexpr size_t framed_header_size = marker.size() + header_size + 4;
+  }
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace BasicLog
+{
+  namespace crc32c_detail
+  {
+    // slicing-by-8 tables for the (reflected) Castagnoli polynomial
+    using Tables = std::array<std::array<uint32_t, 256>, 8>;
+
+    constexpr Tables make_tables()
+    {
+      Tables t{};
+      for (uint32_t i = 0; i < 256; i++)
+      {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+          c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        t[0][i] = c;
+      }
+      for (uint32_t i = 0; i < 256; i++)
+      {
+        for (size_t s = 1; s < 8; s++)
+          t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xff];
+      }
+      return t;
+    }
+
+    inline constexpr Tables tables = make_tables();
+
+    // crc is the raw (not inverted) state
+    inline uint32_t update_sliced(uint32_t crc, const unsigned char* p, size_t n)
+    {
+      auto& t = tables;
+      for (; n >= 8; n -= 8, p += 8)
+      {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, sizeof(lo));
+        std::memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+      }
+      for (; n > 0; n--, p++)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+      return crc;
+    }
+
+    // a * b modulo the polynomial (both reflected, bit 31 is x^0)
+    constexpr uint32_t multiply(uint32_t a, uint32_t b)
+    {
+      uint32_t product = 0;
+      for (uint32_t m = 1u << 31; m != 0 && a != 0; m >>= 1)
+      {
+        if (a & m)
+        {
+          product ^= b;
+          a ^= m;
+        }
+        b = b & 1 ? (b >> 1) ^ 0x82f63b78 : b >> 1;
+      }
+      return product;
+    }
+
+    // x^(2^k) for k = 0..63
+    constexpr std::array<uint32_t, 64> make_powers()
+    {
+      std::array<uint32_t, 64> x{};
+      x[0] = 1u << 30;
+      for (size_t k = 1; k < x.size(); k++)
+        x[k] = multiply(x[k - 1], x[k - 1]);
+      return x;
+    }
+
+    inline constexpr std::array<uint32_t, 64> powers = make_powers();
+
+    // the state after running 'crc' through 'bytes' zeros
+    inline uint32_t shift(uint32_t crc, size_t bytes)
+    {
+      for (size_t k = 3; bytes != 0; bytes >>= 1, k++)
+      {
+        if (bytes & 1)
+          crc = multiply(powers[k], crc);
+      }
+      return crc;
+    }
+
+#if defined(__x86_64__)
+    // picked at run time so it's used whatever -march the program was built with
+    inline bool detect_sse42(void)
+    {
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("sse4.2");
+    }
+
+    inline const bool has_sse42 = detect_sse42();
+
+    __attribute__((target("sse4.2"))) inline uint32_t update_sse42(uint32_t crc, const unsigned char* p, size_t n)
+    {
+      uint64_t c = crc;
+      if (n >= 3 * 1024)
+      {
+        // crc32 has a latency of 3 cycles (and a throughput of 1) so run three independent thirds at once then
+        // combine them: crc(A B C) = shift(crc(A), |B C|) ^ shift(crc0(B), |C|) ^ crc0(C)
+        const size_t lane = n / 3 / 8 * 8;
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < lane; i += 8)
+        {
+          uint64_t v0, v1, v2;
+          std::memcpy(&v0, p + i, sizeof(v0));
+          std::memcpy(&v1, p + lane + i, sizeof(v1));
+          std::memcpy(&v2, p + 2 * lane + i, sizeof(v2));
+          c = _mm_crc32_u64(c, v0);
+          c1 = _mm_crc32_u64(c1, v1);
+          c2 = _mm_crc32_u64(c2, v2);
+        }
+        c = shift((uint32_t)c, 2 * lane) ^ shift((uint32_t)c1, lane) ^ (uint32_t)c2;
+        p += 3 * lane;
+        n -= 3 * lane;
+      }
+      for (; n >= 8; n -= 8, p += 8)
+      {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+      }
+      crc = (uint32_t)c;
+      for (; n > 0; n--, p++)
+        crc = _mm_crc32_u8(crc, *p);
+      return crc;
+    }
+#endif
+  }
+
+  // CRC32C (Castagnoli). pass the previous result as 'crc' to continue over more bytes
+  inline uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0)
+  {
+    const auto* p = static_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    if (crc32c_detail::has_sse42)
+      return ~crc32c_detail::update_sse42(~crc, p, size);
+#endif
+    return ~crc32c_detail::update_sliced(~crc, p, size);
+  }
+}
@@ -1,11 +1,208 @@
 #include <iostream>
 #include "BasicLog.hpp"
+#include "cap_reader.hpp"
 #include <thread>
 
 using namespace BasicLog;
 
+// round trip tests: rows written by Log and read back by Reader
+struct TestRow
+{
+	int32_t i;
+	double x;
+	uint8_t v[200];
+};
+
+// the rows to record: a counter, a double and an array where a few bytes change per row. rows 1000 to 1999 are all the
+// same (so DIFF2 writes REPEATs)
+static std::vector<TestRow> test_rows(void)
+{
+	std::vector<TestRow> rows;
+	TestRow r{};
+	for (int k = 0; k < 3000; k++)
+	{
+		if (k < 1000 || k >= 2000)
+		{
+			r.i = k;
+			r.x = k * 0.25;
+			r.v[k % 200]++;
+			r.v[(k * 7) % 200] = (uint8_t)k;
+		}
+		rows.push_back(r);
+	}
+	return rows;
+}
+
+static void record_rows(Log &L, TestRow &current, const std::vector<TestRow> &rows)
+{
+	for (auto &r : rows)
+	{
+		current = r;
+		L.record();
+	}
+}
+
+// does what R decoded match 'expected' (less the rows [skip_begin, skip_end) of it)
+static bool test_matches(const Reader &R, const std::string_view decoded, std::vector<TestRow> expected, size_t skip_begin = 0, size_t skip_end = 0)
+{
+	expected.erase(expected.begin() + skip_begin, expected.begin() + skip_end);
+	const size_t n = R.rows(decoded);
+	if (n != expected.size())
+	{
+		std::cout << "  " << n << " rows, expected " << expected.size() << '\n';
+		return false;
+	}
+	for (auto &f : R.fields)
+	{
+		std::vector<char> column(n * f.elements() * f.type_size);
+		R.extract(f, decoded, column.data());
+		for (size_t r = 0; r < n; r++)
+		{
+			const auto member = f.name.substr(f.name.rfind('.') + 1); // names are qualified with the log's
+			const char *want = member == "i" ? (const char *)&expected[r].i : member == "x" ? (const char *)&expected[r].x : (const char *)expected[r].v;
+			if (std::memcmp(column.data() + r * f.elements() * f.type_size, want, f.elements() * f.type_size) != 0)
+			{
+				std::cout << "  " << f.name << " differs in row " << r << '\n';
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// returns the number of failures
+static int round_trip_tests(void)
+{
+	const auto root = std::filesystem::temp_directory_path() / "basiclog_test";
+	std::filesystem::remove_all(root);
+	const auto rows = test_rows();
+	int failures = 0;
+	auto check = [&](const std::string_view name, bool ok) {
+		std::cout << (ok ? "pass: " : "FAIL: ") << name << '\n';
+		failures += !ok;
+	};
+
+	// every codec through its own file
+	for (auto method : {Log::RAW, Log::DIFF1, Log::DIFF2, Log::ADAPTIVE})
+	{
+		const std::string name(Log::CompressionMethodName[method]);
+		try
+		{
+			TestRow current{};
+			Log L(name, "round trip", method,
+						Log::Entry("i", "counter", &current.i),
+						Log::Entry("x", "double", &current.x),
+						Log::Entry("v", "sparse changes", current.v));
+			if (method == Log::ADAPTIVE)
+				L.set_adaptive(256, {"RAW", "DIFF1", "DIFF2"});
+			Log::Manager M(root / name, &L);
+			auto dir = M.start();
+			record_rows(L, current, rows);
+			M.stop();
+			Reader R(dir / (name + ".cap"));
+			std::vector<char> storage;
+			check(name, test_matches(R, R.decode(storage), rows) && R.count_rows() == rows.size());
+		}
+		catch (const std::exception &e)
+		{
+			std::cout << "  " << e.what() << '\n';
+			check(name, false);
+		}
+	}
+
+	// framed blocks: a damaged block is skipped and the rest still read back
+	try
+	{
+		TestRow current{};
+		Log L("framed", "round trip", Log::DIFF2,
+					Log::Entry("i", "counter", &current.i),
+					Log::Entry("x", "double", &current.x),
+					Log::Entry("v", "sparse changes", current.v));
+		L.set_framing(true, 100);
+		Log::Manager M(root / "framed", &L);
+		auto dir = M.start();
+		record_rows(L, current, rows);
+		M.stop();
+		const auto path = dir / "framed.cap";
+		std::vector<Reader::Block> blocks;
+		{
+			Reader R(path);
+			std::vector<char> storage;
+			blocks = R.blocks();
+			check("framed", test_matches(R, R.decode(storage), rows) && blocks.size() == 30);
+		}
+		// block offsets are from the end of the header
+		std::string header;
+		std::getline(std::ifstream(path, std::ios::binary), header, '\0');
+		const size_t body_offset = header.size() + 1;
+		// flip a byte in the middle of block 10 (rows 1000 to 1099)
+		{
+			std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+			file.seekg(body_offset + blocks[10].offset + blocks[10].bytes / 2);
+			const char c = file.get() ^ 0x55;
+			file.seekp(body_offset + blocks[10].offset + blocks[10].bytes / 2);
+			file.put(c);
+		}
+		Reader R(path);
+		std::vector<char> storage;
+		size_t damaged = 0;
+		const auto decoded = R.decode(storage, &damaged);
+		check("framed, damaged block", damaged == 1 && test_matches(R, decoded, rows, 1000, 1100));
+	}
+	catch (const std::exception &e)
+	{
+		std::cout << "  " << e.what() << '\n';
+		check("framed", false);
+	}
+
+	// logs sharing a container
+	try
+	{
+		TestRow current{};
+		Log L1("first", "round trip", Log::DIFF1,
+					 Log::Entry("i", "counter", &current.i),
+					 Log::Entry("x", "double", &current.x),
+					 Log::Entry("v", "sparse changes", current.v));
+		Log L2("second", "round trip", Log::DIFF2,
+					 Log::Entry("i", "counter", &current.i),
+					 Log::Entry("x", "double", &current.x),
+					 Log::Entry("v", "sparse changes", current.v));
+		Log::Manager M(root / "container", &L1, &L2);
+		M.set_container(true, 1024);
+		auto dir = M.start();
+		for (auto &r : rows)
+		{
+			current = r;
+			L1.record();
+			L2.record();
+		}
+		M.stop();
+		ContainerReader C(dir / "logs.capc");
+		for (auto name : {"first", "second"})
+		{
+			Reader R(C.stream(name));
+			std::vector<char> storage;
+			check(std::string("container, ").append(name), test_matches(R, R.decode(storage), rows));
+			// and without copying the stream out first
+			std::string batches;
+			C.decode_batches(name, 100, [&](std::string_view decoded) { batches.append(decoded); });
+			check(std::string("container batches, ").append(name), test_matches(R, batches, rows));
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cout << "  " << e.what() << '\n';
+		check("container", false);
+	}
+
+	std::filesystem::remove_all(root);
+	return failures;
+}
+
 int main(void)
 {
+	if (round_trip_tests() != 0)
+		return 1;
 
 	struct simple
 	{
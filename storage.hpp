@@ -0,0 +1,364 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace BasicLog
+{
+  // how a floating point entry is stored when it doesn't need full precision (see Log::Entry::store_as)
+  // the integer types hold round((value - offset) / scale) (saturated) and are read back as stored * scale + offset. their
+  // smallest value (INT8_MIN etc.) is kept for nan, anything else is saturated to one more than that
+  enum class Storage
+  {
+    none,
+    float32,
+    float16,
+    bfloat16,
+    int8,
+    int16,
+    int32,
+    StorageCount
+  };
+
+  // to be included in the header
+  static constexpr std::string_view StorageName[(int)Storage::StorageCount] = { "", "float32", "float16", "bfloat16", "int8", "int16", "int32" };
+  static constexpr size_t StorageSize[(int)Storage::StorageCount] = { 0, 4, 2, 2, 1, 2, 4 };
+
+  constexpr Storage storage_from_name(std::string_view name)
+  {
+    for (int i = 1; i < (int)Storage::StorageCount; i++)
+    {
+      if (StorageName[i] == name)
+        return (Storage)i;
+    }
+    return Storage::none;
+  }
+
+  constexpr bool is_integer_storage(Storage S)
+  {
+    return S == Storage::int8 || S == Storage::int16 || S == Storage::int32;
+  }
+
+  // round to nearest even (F. Giesen's float_to_half_fast3_rtne)
+  inline uint16_t float_to_half(float value)
+  {
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    const uint32_t sign = (f >> 16) & 0x8000;
+    f &= 0x7fffffff;
+    uint16_t h;
+    if (f > 0x7f800000)
+      h = 0x7e00 | ((f >> 13) & 0x3ff); // nan stays a (quiet) nan with the top of its payload, like vcvtps2ph
+    else if (f >= (127 + 16) << 23)
+      h = 0x7c00; // inf (and everything else too big)
+    else if (f < 113 << 23)
+    {
+      // subnormal (or zero). let the fpu do the rounding by lining the result up with the bottom of a float's mantissa
+      const uint32_t magic_bits = 126 << 23;
+      float magic, a;
+      std::memcpy(&magic, &magic_bits, sizeof(magic));
+      std::memcpy(&a, &f, sizeof(a));
+      a += magic;
+      std::memcpy(&f, &a, sizeof(f));
+      h = f - magic_bits;
+    }
+    else
+    {
+      const uint32_t mant_odd = (f >> 13) & 1;
+      f += 0xc8000fff + mant_odd; // rebias the exponent and round
+      h = f >> 13;
+    }
+    return h | sign;
+  }
+
+  inline float half_to_float(uint16_t h)
+  {
+    const uint32_t shifted_exp = 0x7c00 << 13;
+    uint32_t f = (h & 0x7fff) << 13;
+    const uint32_t exp = shifted_exp & f;
+    f += (127 - 15) << 23;
+    float value;
+    if (exp == shifted_exp)
+      f += (128 - 16) << 23; // inf/nan
+    else if (exp == 0)
+    {
+      // subnormal (or zero)
+      const uint32_t magic_bits = 113 << 23;
+      float magic;
+      std::memcpy(&magic, &magic_bits, sizeof(magic));
+      f += 1 << 23;
+      std::memcpy(&value, &f, sizeof(value));
+      value -= magic;
+      std::memcpy(&f, &value, sizeof(f));
+    }
+    f |= (uint32_t)(h & 0x8000) << 16;
+    std::memcpy(&value, &f, sizeof(value));
+    return value;
+  }
+
+  inline uint16_t float_to_bfloat16(float value)
+  {
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    if ((f & 0x7fffffff) > 0x7f800000)
+      return (f >> 16) | 0x40; // keep nan a (quiet) nan
+    return (f + 0x7fff + ((f >> 16) & 1)) >> 16;
+  }
+
+  inline float bfloat16_to_float(uint16_t b)
+  {
+    const uint32_t f = (uint32_t)b << 16;
+    float value;
+    std::memcpy(&value, &f, sizeof(value));
+    return value;
+  }
+
+  namespace storage_detail
+  {
+    // the scalar version of everything in store(). the vector versions below give the same results (nan included)
+    inline void store_one(Storage S, double value, double inv_scale, double offset, char* out)
+    {
+      switch (S)
+      {
+      case Storage::float32:
+      {
+        const float f = (float)value;
+        std::memcpy(out, &f, sizeof(f));
+        break;
+      }
+      case Storage::float16:
+      {
+        const uint16_t h = float_to_half((float)value);
+        std::memcpy(out, &h, sizeof(h));
+        break;
+      }
+      case Storage::bfloat16:
+      {
+        const uint16_t b = float_to_bfloat16((float)value);
+        std::memcpy(out, &b, sizeof(b));
+        break;
+      }
+      default:
+      {
+        double v = (value - offset) * inv_scale;
+        const double hi = S == Storage::int8 ? INT8_MAX : (S == Storage::int16 ? INT16_MAX : INT32_MAX);
+        const double lo = S == Storage::int8 ? INT8_MIN : (S == Storage::int16 ? INT16_MIN : INT32_MIN);
+        v = std::isnan(v) ? lo : std::clamp(v, lo + 1, hi);
+        const int32_t i = (int32_t)std::nearbyint(v);
+        if (S == Storage::int8)
+          *out = (int8_t)i;
+        else if (S == Storage::int16)
+        {
+          const int16_t s = (int16_t)i;
+          std::memcpy(out, &s, sizeof(s));
+        }
+        else
+          std::memcpy(out, &i, sizeof(i));
+        break;
+      }
+      }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // the vector versions are picked at run time so they're used whatever -march the program was built with
+    struct Cpu
+    {
+      bool avx;
+      bool f16c;
+      bool avx2;
+    };
+
+    inline Cpu detect_cpu(void)
+    {
+      __builtin_cpu_init();
+      const bool avx = __builtin_cpu_supports("avx");
+      return Cpu{ avx, avx && __builtin_cpu_supports("f16c"), avx && __builtin_cpu_supports("avx2") };
+    }
+
+    inline const Cpu cpu = detect_cpu();
+
+    // 4 doubles at a time. returns how many were done
+    __attribute__((target("avx"))) inline size_t store_avx(Storage S, const double* in, size_t n, double inv_scale, double offset, char* out)
+    {
+      size_t i = 0;
+      const size_t size = StorageSize[(int)S];
+      switch (S)
+      {
+      case Storage::float32:
+        for (; i + 4 <= n; i += 4)
+          _mm_storeu_ps((float*)(out + i * size), _mm256_cvtpd_ps(_mm256_loadu_pd(in + i)));
+        break;
+      case Storage::int8:
+      case Storage::int16:
+      case Storage::int32:
+      {
+        const double hi = S == Storage::int8 ? INT8_MAX : (S == Storage::int16 ? INT16_MAX : INT32_MAX);
+        const double lo = S == Storage::int8 ? INT8_MIN : (S == Storage::int16 ? INT16_MIN : INT32_MIN);
+        const __m256d vhi = _mm256_set1_pd(hi), vlo = _mm256_set1_pd(lo + 1), vnan = _mm256_set1_pd(lo);
+        const __m256d voff = _mm256_set1_pd(offset), vscale = _mm256_set1_pd(inv_scale);
+        for (; i + 4 <= n; i += 4)
+        {
+          __m256d v = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(in + i), voff), vscale);
+          const __m256d nan = _mm256_cmp_pd(v, v, _CMP_UNORD_Q);
+          v = _mm256_blendv_pd(_mm256_max_pd(_mm256_min_pd(v, vhi), vlo), vnan, nan);
+          __m128i x = _mm256_cvtpd_epi32(v); // rounds to nearest even
+          if (S == Storage::int32)
+            _mm_storeu_si128((__m128i*)(out + i * size), x);
+          else if (S == Storage::int16)
+            _mm_storel_epi64((__m128i*)(out + i * size), _mm_packs_epi32(x, x));
+          else
+          {
+            const int32_t packed = _mm_cvtsi128_si32(_mm_packs_epi16(_mm_packs_epi32(x, x), x));
+            std::memcpy(out + i * size, &packed, sizeof(packed));
+          }
+        }
+        break;
+      }
+      default:
+        break;
+      }
+      return i;
+    }
+
+    __attribute__((target("avx,f16c"))) inline size_t store_float16_f16c(const double* in, size_t n, char* out)
+    {
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm_storel_epi64((__m128i*)(out + i * 2), _mm_cvtps_ph(_mm256_cvtpd_ps(_mm256_loadu_pd(in + i)), _MM_FROUND_TO_NEAREST_INT));
+      return i;
+    }
+
+    __attribute__((target("avx,f16c"))) inline size_t store_float16_f16c(const float* in, size_t n, char* out)
+    {
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8)
+        _mm_storeu_si128((__m128i*)(out + i * 2), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+      return i;
+    }
+
+    // 8 floats at a time (bfloat16 only, everything else goes through doubles)
+    __attribute__((target("avx2"))) inline size_t store_bfloat16_avx2(const float* in, size_t n, char* out)
+    {
+      size_t i = 0;
+      const __m256i one = _mm256_set1_epi32(1), round = _mm256_set1_epi32(0x7fff), quiet = _mm256_set1_epi32(0x40);
+      for (; i + 8 <= n; i += 8)
+      {
+        const __m256 f = _mm256_loadu_ps(in + i);
+        const __m256i b = _mm256_castps_si256(f);
+        __m256i r = _mm256_srli_epi32(_mm256_add_epi32(b, _mm256_add_epi32(round, _mm256_and_si256(_mm256_srli_epi32(b, 16), one))), 16);
+        const __m256i nan = _mm256_or_si256(_mm256_srli_epi32(b, 16), quiet);
+        r = _mm256_blendv_epi8(r, nan, _mm256_castps_si256(_mm256_cmp_ps(f, f, _CMP_UNORD_Q)));
+        _mm_storeu_si128((__m128i*)(out + i * 2), _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+      }
+      return i;
+    }
+#endif
+  }
+
+  // convert n values to S
+  inline void store(Storage S, const double* in, size_t n, double scale, double offset, char* out)
+  {
+    const double inv_scale = 1.0 / scale;
+    const size_t size = StorageSize[(int)S];
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    const auto& cpu = storage_detail::cpu;
+    if (S == Storage::float16 && cpu.f16c)
+      i = storage_detail::store_float16_f16c(in, n, out);
+    else if (cpu.avx)
+      i = storage_detail::store_avx(S, in, n, inv_scale, offset, out);
+    if (S == Storage::bfloat16 && cpu.avx2)
+    {
+      // via floats
+      float f[64];
+      while (i < n)
+      {
+        const size_t m = std::min<size_t>(n - i, 64);
+        for (size_t k = 0; k < m; k++)
+          f[k] = (float)in[i + k];
+        const size_t done = storage_detail::store_bfloat16_avx2(f, m, out + i * size);
+        for (size_t k = done; k < m; k++)
+          storage_detail::store_one(S, f[k], inv_scale, offset, out + (i + k) * size);
+        i += m;
+      }
+    }
+#endif
+    for (; i < n; i++)
+      storage_detail::store_one(S, in[i], inv_scale, offset, out + i * size);
+  }
+
+  inline void store(Storage S, const float* in, size_t n, double scale, double offset, char* out)
+  {
+    const size_t size = StorageSize[(int)S];
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (S == Storage::float16 && storage_detail::cpu.f16c)
+      i = storage_detail::store_float16_f16c(in, n, out);
+    if (S == Storage::bfloat16 && storage_detail::cpu.avx2)
+      i = storage_detail::store_bfloat16_avx2(in, n, out);
+#endif
+    // everything else (and whatever is left over) goes through doubles (float -> double is exact)
+    double d[64];
+    while (i < n)
+    {
+      const size_t m = std::min<size_t>(n - i, 64);
+      for (size_t k = 0; k < m; k++)
+        d[k] = in[i + k];
+      store(S, d, m, scale, offset, out + i * size);
+      i += m;
+    }
+  }
+
+  // read n stored values back
+  inline void load(Storage S, const char* in, size_t n, double scale, double offset, double* out)
+  {
+    const size_t size = StorageSize[(int)S];
+    for (size_t i = 0; i < n; i++, in += size)
+    {
+      switch (S)
+      {
+      case Storage::float32:
+      {
+        float f;
+        std::memcpy(&f, in, sizeof(f));
+        out[i] = f;
+        break;
+      }
+      case Storage::float16:
+      case Storage::bfloat16:
+      {
+        uint16_t h;
+        std::memcpy(&h, in, sizeof(h));
+        out[i] = S == Storage::float16 ? half_to_float(h) : bfloat16_to_float(h);
+        break;
+      }
+      case Storage::int8:
+        out[i] = (int8_t)*in == INT8_MIN ? std::numeric_limits<double>::quiet_NaN() : (int8_t)*in * scale + offset;
+        break;
+      case Storage::int16:
+      {
+        int16_t s;
+        std::memcpy(&s, in, sizeof(s));
+        out[i] = s == INT16_MIN ? std::numeric_limits<double>::quiet_NaN() : s * scale + offset;
+        break;
+      }
+      case Storage::int32:
+      {
+        int32_t s;
+        std::memcpy(&s, in, sizeof(s));
+        out[i] = s == INT32_MIN ? std::numeric_limits<double>::quiet_NaN() : s * scale + offset;
+        break;
+      }
+      default:
+        break;
+      }
+    }
+  }
+}
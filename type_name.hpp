@@ -1,5 +1,7 @@
 #pragma once
 #include <cstdint>
+#include <cstddef>
+#include <string_view>
 #include <type_traits>
 
 namespace BasicLog_detail
@@ -42,6 +44,17 @@ namespace BasicLog_detail
 	X_LIST_BASICLOG_TYPES
 #undef X
 
+	// size of a type given "my name" (0 if it's not a fundamental type). used when reading a header back in
+	constexpr size_t type_size(std::string_view name)
+	{
+#define X(type, name_)   \
+	if (name == #name_)    \
+		return sizeof(type);
+		X_LIST_BASICLOG_TYPES
+#undef X
+		return 0;
+	}
+
 #undef X_LIST_TYPES
 }
 
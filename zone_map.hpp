@@ -0,0 +1,121 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+
+namespace BasicLog
+{
+  // per block summaries of a log (see Log::set_zone_maps) so readers can skip blocks that can't match a query.
+  // they're written next to the log as <log name>.zmap (a capture's is named like the capture):
+  //   a json header {"zone_map":1,"log":"{name}","row_size":{row_size},"sums":{bool},"fields":[{"name":"{name}","type":"{type}"},...]}
+  //   a zero byte
+  //   a record per block: where the block starts in the log's stream (uint64, bytes after the log's header and its zero),
+  //   rows (uint32), then the min, max (and sum when "sums" is true) of every field (float64 each)
+  // min/max are over every element of every instance of a field and are rounded outward when they don't fit a double.
+  // nan is ignored so a block that's all nan has min = inf, max = -inf
+  namespace zone_map
+  {
+    struct Summary
+    {
+      double min;
+      double max;
+      double sum;
+    };
+
+    inline constexpr size_t record_header_size = 8 + 4;
+
+    inline size_t record_size(size_t fields, bool sums)
+    {
+      return record_header_size + fields * (sums ? 3 : 2) * sizeof(double);
+    }
+
+    // min/max/sum of n values. independent lanes (and min/max written the way minps/maxps work) so this vectorizes
+    template <typename T>
+    Summary summarize(const T* v, size_t n, bool sums)
+    {
+      constexpr size_t L = 128 / sizeof(T); // four 256 bit registers' worth (min/max take a few cycles each)
+      constexpr T highest = std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+      constexpr T lowest = std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+      T lo[L], hi[L];
+      for (size_t k = 0; k < L; k++)
+      {
+        lo[k] = highest;
+        hi[k] = lowest;
+      }
+      size_t i = 0;
+      for (; i + L <= n; i += L)
+      {
+        for (size_t k = 0; k < L; k++)
+        {
+          lo[k] = v[i + k] < lo[k] ? v[i + k] : lo[k];
+          hi[k] = v[i + k] > hi[k] ? v[i + k] : hi[k];
+        }
+      }
+      for (size_t k = 0; i + k < n; k++)
+      {
+        lo[k] = v[i + k] < lo[k] ? v[i + k] : lo[k];
+        hi[k] = v[i + k] > hi[k] ? v[i + k] : hi[k];
+      }
+      for (size_t k = 1; k < L; k++)
+      {
+        lo[0] = lo[k] < lo[0] ? lo[k] : lo[0];
+        hi[0] = hi[k] > hi[0] ? hi[k] : hi[0];
+      }
+
+      Summary s{ (double)lo[0], (double)hi[0], 0.0 };
+      if constexpr (std::is_integral_v<T> && sizeof(T) == 8)
+      {
+        // not every 64 bit integer is a double
+        if ((double)lo[0] > 0x1p53 || (double)lo[0] < -0x1p53)
+          s.min = std::nextafter(s.min, -INFINITY);
+        if ((double)hi[0] > 0x1p53 || (double)hi[0] < -0x1p53)
+          s.max = std::nextafter(s.max, INFINITY);
+      }
+      if (sums)
+      {
+        constexpr size_t S = 16;
+        double total[S] = {};
+        size_t j = 0;
+        for (; j + S <= n; j += S)
+        {
+          for (size_t k = 0; k < S; k++)
+            total[k] += (double)v[j + k];
+        }
+        for (; j < n; j++)
+          total[0] += (double)v[j];
+        for (size_t k = 1; k < S; k++)
+          s.sum += total[k];
+        s.sum += total[0];
+      }
+      return s;
+    }
+
+    // summarize() for the header's type names. nullptr if there isn't one
+    using Summarizer = Summary (*)(const char* values, size_t n, bool sums);
+
+    template <typename T>
+    Summary summarize_bytes(const char* values, size_t n, bool sums)
+    {
+      return summarize((const T*)values, n, sums);
+    }
+
+    inline Summarizer summarizer_for(std::string_view type)
+    {
+      if (type == "float64") return summarize_bytes<double>;
+      if (type == "float32") return summarize_bytes<float>;
+      if (type == "int8" || type == "char") return summarize_bytes<int8_t>;
+      if (type == "uint8" || type == "bool") return summarize_bytes<uint8_t>;
+      if (type == "int16") return summarize_bytes<int16_t>;
+      if (type == "uint16") return summarize_bytes<uint16_t>;
+      if (type == "int32") return summarize_bytes<int32_t>;
+      if (type == "uint32") return summarize_bytes<uint32_t>;
+      if (type == "int64") return summarize_bytes<int64_t>;
+      if (type == "uint64") return summarize_bytes<uint64_t>;
+      return nullptr;
+    }
+  }
+}